@@ -0,0 +1,497 @@
+/*
+ *  _____ _____ _____ _____ _____
+ * |     |  _  |   | |   __|     |
+ * | | | |     | | | |  |  |  |  |
+ * |_|_|_|__|__|_|___|_____|_____|
+ *
+ * Mango Virtual Machine 1.0-dev
+ *
+ * Copyright (c) 2019 Klaus Hartke
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "../src/mango.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The images below only use the opcodes of the features they declare, so
+// they are assembled against the full opcode table no matter how the library
+// is configured. Images whose features are missing are skipped at run time.
+
+#undef MANGO_NO_I64
+#undef MANGO_NO_F32
+#undef MANGO_NO_F64
+#undef MANGO_NO_REFS
+
+enum {
+#define OPCODE(c, s, pop, push, args, i) c = i,
+#include "../src/mango_opcodes.inc"
+#undef OPCODE
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define ITERATIONS 4000000
+#define SYSCALL_ITERATIONS 1000000
+#define SUM_ITERATIONS 20000
+#define FIB_N 27
+#define REPEAT 5
+
+#define U16(Value) (Value) & 0xFF, ((Value) >> 8) & 0xFF
+#define I32(Value)                                                             \
+  (Value) & 0xFF, ((Value) >> 8) & 0xFF, ((Value) >> 16) & 0xFF,               \
+      ((Value) >> 24) & 0xFF
+#define U64(Value) I32((Value)&0xFFFFFFFF), I32((Value) >> 32)
+
+// Module header with an entry point that calls the function at offset 8.
+#define HEADER(Features) 1, Features, 1, 0, CALL_S, U16(8), HALT
+
+// Every image reports its result through syscall 0, so a broken image or
+// interpreter is caught instead of timed. Offsets are relative to the first
+// instruction of each function.
+
+// i32 arithmetic in a counted loop: acc = (acc + i) ^ 7.
+static const uint8_t arith_i32[] = {
+    HEADER(0x00),
+    0, 2, 2,                       // args 0, locals i acc, stack 2
+    /*  0 */ LDC_X32, I32(ITERATIONS),
+    /*  5 */ STLOC_X32, 1,         // i
+    /*  7 */ LDC_I32_0,
+    /*  8 */ STLOC_X32, 2,         // acc
+    /* 10 */ BR_S, 15,             // -> 27
+    /* 12 */ LDLOC_X32, 1,         // acc
+    /* 14 */ LDLOC_X32, 1,         // i
+    /* 16 */ ADD_I32,
+    /* 17 */ LDC_I32_7,
+    /* 18 */ XOR_I32,
+    /* 19 */ STLOC_X32, 2,         // acc
+    /* 21 */ LDLOC_X32, 0,         // i
+    /* 23 */ LDC_I32_1,
+    /* 24 */ SUB_I32,
+    /* 25 */ STLOC_X32, 1,         // i
+    /* 27 */ LDLOC_X32, 0,         // i
+    /* 29 */ BRTRUE_S, 0xED,       // -> 12
+    /* 31 */ LDLOC_X32, 1,         // acc
+    /* 33 */ SYSCALL, 0, U16(0),
+    /* 37 */ POP_X32,
+    /* 38 */ RET,
+};
+
+// i32 loop in the shape that superinstructions target:
+// for (i = 0; i < n; i += 1) acc += i.
+static const uint8_t loop_i32[] = {
+    HEADER(0x00),
+    0, 3, 2,                       // args 0, locals i n acc, stack 2
+    /*  0 */ LDC_X32, I32(ITERATIONS),
+    /*  5 */ STLOC_X32, 2,         // n
+    /*  7 */ LDC_I32_0,
+    /*  8 */ STLOC_X32, 1,         // i
+    /* 10 */ LDC_I32_0,
+    /* 11 */ STLOC_X32, 3,         // acc
+    /* 13 */ BR_S, 14,             // -> 29
+    /* 15 */ LDLOC_X32, 2,         // acc
+    /* 17 */ LDLOC_X32, 1,         // i
+    /* 19 */ ADD_I32,
+    /* 20 */ STLOC_X32, 3,         // acc
+    /* 22 */ LDLOC_X32, 0,         // i
+    /* 24 */ LDC_I32_S, 1,
+    /* 26 */ ADD_I32,
+    /* 27 */ STLOC_X32, 1,         // i
+    /* 29 */ LDLOC_X32, 0,         // i
+    /* 31 */ LDLOC_X32, 2,         // n
+    /* 33 */ CLT_I32,
+    /* 34 */ BRTRUE_S, 0xEB,       // -> 15
+    /* 36 */ LDLOC_X32, 2,         // acc
+    /* 38 */ SYSCALL, 0, U16(0),
+    /* 42 */ POP_X32,
+    /* 43 */ RET,
+};
+
+// f64 multiply-add in a counted loop: x = x * 0.999999 + 0.5.
+static const uint8_t math_f64[] = {
+    HEADER(0x40),
+    0, 3, 4,                       // args 0, locals i x, stack 4
+    /*  0 */ LDC_X32, I32(ITERATIONS),
+    /*  5 */ STLOC_X32, 1,         // i
+    /*  7 */ LDC_X64, U64(0x3FF0000000000000), // 1.0
+    /* 16 */ STLOC_X64, 3,         // x
+    /* 18 */ BR_S, 30,             // -> 50
+    /* 20 */ LDLOC_X64, 1,         // x
+    /* 22 */ LDC_X64, U64(0x3FEFFFFDE7210BE9), // 0.999999
+    /* 31 */ MUL_F64,
+    /* 32 */ LDC_X64, U64(0x3FE0000000000000), // 0.5
+    /* 41 */ ADD_F64,
+    /* 42 */ STLOC_X64, 3,         // x
+    /* 44 */ LDLOC_X32, 0,         // i
+    /* 46 */ LDC_I32_1,
+    /* 47 */ SUB_I32,
+    /* 48 */ STLOC_X32, 1,         // i
+    /* 50 */ LDLOC_X32, 0,         // i
+    /* 52 */ BRTRUE_S, 0xDE,       // -> 20
+    /* 54 */ LDLOC_X64, 1,         // x
+    /* 56 */ SYSCALL, 0, U16(0),
+    /* 60 */ POP_X64,
+    /* 61 */ RET,
+};
+
+// Naive recursive Fibonacci, dominated by CALL_S and RET_X32.
+static const uint8_t call_fib[] = {
+    HEADER(0x00),
+    0, 0, 1,                       // args 0, locals 0, stack 1
+    /*  0 */ LDC_I32_S, FIB_N,
+    /*  2 */ CALL_S, U16(22),      // fib
+    /*  5 */ SYSCALL, 0, U16(0),
+    /*  9 */ POP_X32,
+    /* 10 */ RET,
+    1, 0, 3,                       // fib: args n, locals 0, stack 3
+    /*  0 */ LDLOC_X32, 0,         // n
+    /*  2 */ LDC_I32_2,
+    /*  3 */ CLT_I32,
+    /*  4 */ BRTRUE_S, 16,         // -> 22
+    /*  6 */ LDLOC_X32, 0,         // n
+    /*  8 */ LDC_I32_1,
+    /*  9 */ SUB_I32,
+    /* 10 */ CALL_S, U16(22),      // fib
+    /* 13 */ LDLOC_X32, 1,         // n
+    /* 15 */ LDC_I32_2,
+    /* 16 */ SUB_I32,
+    /* 17 */ CALL_S, U16(22),      // fib
+    /* 20 */ ADD_I32,
+    /* 21 */ RET_X32,
+    /* 22 */ LDLOC_X32, 0,         // n
+    /* 24 */ RET_X32,
+};
+
+// Array elements and an object field: a[i & 63] += i; o.count += 1.
+static const uint8_t field_array[] = {
+    HEADER(0x80),
+    0, 4, 7,                       // args 0, locals i o a, stack 7
+    /*  0 */ LDC_I32_S, 64,
+    /*  2 */ NEWARR, U16(4),
+    /*  5 */ STLOC_X64, 4,         // a
+    /*  7 */ NEWOBJ, U16(4),
+    /* 10 */ STLOC_X32, 2,         // o
+    /* 12 */ LDC_X32, I32(ITERATIONS),
+    /* 17 */ STLOC_X32, 1,         // i
+    /* 19 */ BR_S, 36,             // -> 57
+    /* 21 */ LDLOC_X64, 2,         // a
+    /* 23 */ LDLOC_X32, 2,         // i
+    /* 25 */ LDC_I32_S, 63,
+    /* 27 */ AND_I32,
+    /* 28 */ LDLOC_X64, 5,         // a
+    /* 30 */ LDLOC_X32, 5,         // i
+    /* 32 */ LDC_I32_S, 63,
+    /* 34 */ AND_I32,
+    /* 35 */ LDELEM_X32,
+    /* 36 */ LDLOC_X32, 4,         // i
+    /* 38 */ ADD_I32,
+    /* 39 */ STELEM_X32,
+    /* 40 */ LDLOC_X32, 1,         // o
+    /* 42 */ DUP_X32,
+    /* 43 */ LDFLD_X32, U16(0),    // count
+    /* 46 */ LDC_I32_1,
+    /* 47 */ ADD_I32,
+    /* 48 */ STFLD_X32, U16(0),    // count
+    /* 51 */ LDLOC_X32, 0,         // i
+    /* 53 */ LDC_I32_1,
+    /* 54 */ SUB_I32,
+    /* 55 */ STLOC_X32, 1,         // i
+    /* 57 */ LDLOC_X32, 0,         // i
+    /* 59 */ BRTRUE_S, 0xD8,       // -> 21
+    /* 61 */ LDLOC_X32, 1,         // o
+    /* 63 */ LDFLD_X32, U16(0),    // count
+    /* 66 */ SYSCALL, 0, U16(0),
+    /* 70 */ POP_X32,
+    /* 71 */ RET,
+};
+
+// The sum of a[j] = j over 1024 elements, element by element: acc += a[j].
+static const uint8_t sum_i32[] = {
+    HEADER(0x80),
+    0, 5, 4,                       // args 0, locals n j acc a, stack 4
+    /*  0 */ LDC_X32, I32(1024),
+    /*  5 */ NEWARR, U16(4),
+    /*  8 */ STLOC_X64, 5,         // a
+    /* 10 */ LDC_X32, I32(1024),
+    /* 15 */ STLOC_X32, 2,         // j
+    /* 17 */ BR_S, 13,             // -> 32
+    /* 19 */ LDLOC_X32, 1,         // j
+    /* 21 */ LDC_I32_1,
+    /* 22 */ SUB_I32,
+    /* 23 */ STLOC_X32, 2,         // j
+    /* 25 */ LDLOC_X64, 3,         // a
+    /* 27 */ LDLOC_X32, 3,         // j
+    /* 29 */ LDLOC_X32, 4,         // j
+    /* 31 */ STELEM_X32,
+    /* 32 */ LDLOC_X32, 1,         // j
+    /* 34 */ BRTRUE_S, 0xEF,       // -> 19
+    /* 36 */ LDC_X32, I32(SUM_ITERATIONS),
+    /* 41 */ STLOC_X32, 1,         // n
+    /* 43 */ BR_S, 35,             // -> 80
+    /* 45 */ LDC_X32, I32(1024),
+    /* 50 */ STLOC_X32, 2,         // j
+    /* 52 */ BR_S, 16,             // -> 70
+    /* 54 */ LDLOC_X32, 1,         // j
+    /* 56 */ LDC_I32_1,
+    /* 57 */ SUB_I32,
+    /* 58 */ STLOC_X32, 2,         // j
+    /* 60 */ LDLOC_X32, 2,         // acc
+    /* 62 */ LDLOC_X64, 4,         // a
+    /* 64 */ LDLOC_X32, 4,         // j
+    /* 66 */ LDELEM_X32,
+    /* 67 */ ADD_I32,
+    /* 68 */ STLOC_X32, 3,         // acc
+    /* 70 */ LDLOC_X32, 1,         // j
+    /* 72 */ BRTRUE_S, 0xEC,       // -> 54
+    /* 74 */ LDLOC_X32, 0,         // n
+    /* 76 */ LDC_I32_1,
+    /* 77 */ SUB_I32,
+    /* 78 */ STLOC_X32, 1,         // n
+    /* 80 */ LDLOC_X32, 0,         // n
+    /* 82 */ BRTRUE_S, 0xD9,       // -> 45
+    /* 84 */ LDLOC_X32, 2,         // acc
+    /* 86 */ SYSCALL, 0, U16(0),
+    /* 90 */ POP_X32,
+    /* 91 */ RET,
+};
+
+// The same sum with one vsum.i32 per 1024 elements.
+static const uint8_t vsum_i32[] = {
+    HEADER(0x80),
+    0, 4, 4,                       // args 0, locals n acc a, stack 4
+    /*  0 */ LDC_X32, I32(1024),
+    /*  5 */ NEWARR, U16(4),
+    /*  8 */ STLOC_X64, 4,         // a
+    /* 10 */ LDC_X32, I32(1024),
+    /* 15 */ STLOC_X32, 1,         // n
+    /* 17 */ BR_S, 13,             // -> 32
+    /* 19 */ LDLOC_X32, 0,         // n
+    /* 21 */ LDC_I32_1,
+    /* 22 */ SUB_I32,
+    /* 23 */ STLOC_X32, 1,         // n
+    /* 25 */ LDLOC_X64, 2,         // a
+    /* 27 */ LDLOC_X32, 2,         // n
+    /* 29 */ LDLOC_X32, 3,         // n
+    /* 31 */ STELEM_X32,
+    /* 32 */ LDLOC_X32, 0,         // n
+    /* 34 */ BRTRUE_S, 0xEF,       // -> 19
+    /* 36 */ LDC_X32, I32(SUM_ITERATIONS),
+    /* 41 */ STLOC_X32, 1,         // n
+    /* 43 */ BR_S, 14,             // -> 59
+    /* 45 */ LDLOC_X32, 1,         // acc
+    /* 47 */ LDLOC_X64, 3,         // a
+    /* 49 */ VSUM_I32,
+    /* 50 */ ADD_I32,
+    /* 51 */ STLOC_X32, 2,         // acc
+    /* 53 */ LDLOC_X32, 0,         // n
+    /* 55 */ LDC_I32_1,
+    /* 56 */ SUB_I32,
+    /* 57 */ STLOC_X32, 1,         // n
+    /* 59 */ LDLOC_X32, 0,         // n
+    /* 61 */ BRTRUE_S, 0xEE,       // -> 45
+    /* 63 */ LDLOC_X32, 1,         // acc
+    /* 65 */ SYSCALL, 0, U16(0),
+    /* 69 */ POP_X32,
+    /* 70 */ RET,
+};
+
+// One syscall 1 per iteration, completed by the host or a native function.
+static const uint8_t syscall_loop[] = {
+    HEADER(0x00),
+    0, 1, 2,                       // args 0, locals i, stack 2
+    /*  0 */ LDC_X32, I32(SYSCALL_ITERATIONS),
+    /*  5 */ STLOC_X32, 1,         // i
+    /*  7 */ BR_S, 13,             // -> 22
+    /*  9 */ LDLOC_X32, 0,         // i
+    /* 11 */ SYSCALL, 0, U16(1),
+    /* 15 */ POP_X32,
+    /* 16 */ LDLOC_X32, 0,         // i
+    /* 18 */ LDC_I32_1,
+    /* 19 */ SUB_I32,
+    /* 20 */ STLOC_X32, 1,         // i
+    /* 22 */ LDLOC_X32, 0,         // i
+    /* 24 */ BRTRUE_S, 0xEF,       // -> 9
+    /* 26 */ LDC_I32_0,
+    /* 27 */ SYSCALL, 0, U16(0),
+    /* 31 */ POP_X32,
+    /* 32 */ RET,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct benchmark {
+  const char *name;
+  const uint8_t *image;
+  size_t size;
+  uint64_t ops;
+  uint64_t dispatches;
+  uint64_t expected;
+  size_t result_size;
+  int features;
+  int native;
+} benchmark;
+
+static const benchmark benchmarks[] = {
+    {"arith.i32", arith_i32, sizeof(arith_i32), ITERATIONS,
+     12ull * ITERATIONS, 0xA5470480, 4, 0, 0},
+    {"loop.i32", loop_i32, sizeof(loop_i32), ITERATIONS, 12ull * ITERATIONS,
+     0xA509FB80, 4, 0, 0},
+    {"math.f64", math_f64, sizeof(math_f64), ITERATIONS, 12ull * ITERATIONS,
+     0x411DF568DE62CF85, 8, MANGO_FEATURE_F64, 0},
+    // fib(27) makes 635621 calls; 317811 of them return right away.
+    {"call.fib", call_fib, sizeof(call_fib), 635621,
+     6ull * 317811 + 14ull * 317810, 196418, 4, 0, 0},
+    {"field.array", field_array, sizeof(field_array), ITERATIONS,
+     24ull * ITERATIONS, ITERATIONS, 4, MANGO_FEATURE_REFS, 0},
+    // Both sums count elements as ops; 20000 * 523776 wraps to 0x7063C000.
+    {"sum.i32", sum_i32, sizeof(sum_i32), 1024ull * SUM_ITERATIONS,
+     12ull * 1024 * SUM_ITERATIONS, 0x7063C000, 4, MANGO_FEATURE_REFS, 0},
+    {"vsum.i32", vsum_i32, sizeof(vsum_i32), 1024ull * SUM_ITERATIONS,
+     11ull * SUM_ITERATIONS, 0x7063C000, 4, MANGO_FEATURE_REFS, 0},
+    {"syscall.yield", syscall_loop, sizeof(syscall_loop), SYSCALL_ITERATIONS,
+     9ull * SYSCALL_ITERATIONS, 0, 4, 0, 0},
+    {"syscall.native", syscall_loop, sizeof(syscall_loop), SYSCALL_ITERATIONS,
+     9ull * SYSCALL_ITERATIONS, 0, 4, 0, 1},
+};
+
+static mango_result nop_syscall(mango_vm *vm, const void *arguments,
+                                void *results) {
+  (void)vm;
+  (void)arguments;
+  (void)results;
+  return MANGO_E_SUCCESS;
+}
+
+static const mango_syscall_func natives[] = {NULL, nop_syscall};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Profiling builds count the instructions the interpreter actually
+// dispatches, which shows how many of them superinstructions save.
+
+static uint64_t profile[(1 << 20) / sizeof(uint64_t)];
+
+static uint64_t count_dispatches(const mango_vm *vm) {
+  static char text[1 << 14];
+  uint64_t total = 0;
+
+  mango_profile_dump(vm, MANGO_PROFILE_OPCODES, text, sizeof(text));
+  for (const char *p = text; *p != '\0'; p = strchr(p, '\n') + 1) {
+    total += strtoull(strchr(p, ' ') + 1, NULL, 10);
+  }
+  return total;
+}
+
+static mango_result run(const benchmark *b, double *seconds,
+                        uint64_t *dispatches) {
+  static uint64_t memory[1 << 14];
+  static const uint8_t fingerprint[12];
+
+  mango_vm *vm = mango_initialize(memory, sizeof(memory), 1 << 15, NULL);
+  if (!vm) {
+    return MANGO_E_OUT_OF_MEMORY;
+  }
+
+  mango_result result =
+      mango_module_import(vm, fingerprint, b->image, b->size, NULL);
+  if (result != MANGO_E_SUCCESS) {
+    return result;
+  }
+  if (b->native) {
+    mango_syscall_register(vm, natives, sizeof(natives) / sizeof(natives[0]));
+  }
+  if (dispatches) {
+    mango_profile_attach(vm, profile, sizeof(profile));
+  }
+
+  uint64_t value = ~b->expected;
+  double start = now();
+
+  while ((result = mango_run(vm)) == MANGO_E_SYSTEM_CALL) {
+    if (mango_syscall(vm) == 0) {
+      value = 0;
+      memcpy(&value, mango_stack_top(vm), b->result_size);
+    }
+  }
+
+  *seconds = now() - start;
+  if (result == MANGO_E_SUCCESS && value != b->expected) {
+    result = MANGO_E_INVALID_PROGRAM;
+  }
+  if (dispatches) {
+    *dispatches = count_dispatches(vm);
+  }
+  return result;
+}
+
+int main(void) {
+  int failed = 0;
+
+  int counted = mango_profile_size(1) != 0;
+
+  printf("mango %s, features 0x%02x, config %s\n\n", mango_version_string(),
+         mango_features(), BENCH_CONFIG);
+  printf("%-16s %12s %14s %12s\n", "benchmark", "ns/op", "Mdispatch/s",
+         "dispatch/op");
+
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+    const benchmark *b = &benchmarks[i];
+    double best = 0;
+    uint64_t dispatches = b->dispatches;
+
+    if ((mango_features() & b->features) != b->features) {
+      printf("%-16s %12s %14s %12s\n", b->name, "-", "-", "-");
+      continue;
+    }
+
+    for (int r = 0; r < REPEAT; r++) {
+      double seconds;
+      mango_result result =
+          run(b, &seconds, counted && r == 0 ? &dispatches : NULL);
+
+      if (result != MANGO_E_SUCCESS) {
+        printf("%-16s failed with %d\n", b->name, (int)result);
+        failed = 1;
+        best = 0;
+        break;
+      }
+      if (r == 0 || seconds < best) {
+        best = seconds;
+      }
+    }
+
+    if (best > 0) {
+      printf("%-16s %12.2f %14.1f %12.2f\n", b->name,
+             best * 1e9 / (double)b->ops, (double)dispatches / best * 1e-6,
+             (double)dispatches / (double)b->ops);
+    }
+  }
+
+  return failed;
+}
@@ -27,12 +27,73 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#if defined(MANGO_JIT) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include "mango.h"
 #include "mango_metadata.h"
 
 #include <math.h>
 #include <string.h>
 
+#if defined(MANGO_JIT)
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+#else
+#undef MANGO_JIT
+#endif
+#endif
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(MANGO_SCHEDULER)
+#if !defined(_WIN32) && !defined(__STDC_NO_ATOMICS__)
+#include <pthread.h>
+#include <stdatomic.h>
+#else
+#undef MANGO_SCHEDULER
+#endif
+#endif
+
+#if defined(MANGO_SAMPLING)
+#if !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#else
+#undef MANGO_SAMPLING
+#endif
+#endif
+
+#if defined(MANGO_FOREIGN_SLICES) &&                                           \
+    (defined(MANGO_NO_REFS) || UINTPTR_MAX != UINT64_MAX)
+#undef MANGO_FOREIGN_SLICES
+#endif
+
+#if defined(MANGO_JIT) && defined(MANGO_PROFILE)
+#error MANGO_JIT and MANGO_PROFILE cannot be combined
+#endif
+
+// Function multiversioning resolves its clones before ThreadSanitizer is set
+// up, so sanitized builds go without it, as can any build that defines this.
+
+#if defined(__SANITIZE_THREAD__) && !defined(MANGO_NO_TARGET_CLONES)
+#define MANGO_NO_TARGET_CLONES
+#endif
+
+#if defined(__has_feature) && !defined(MANGO_NO_TARGET_CLONES)
+#if __has_feature(thread_sanitizer)
+#define MANGO_NO_TARGET_CLONES
+#endif
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 
 #pragma GCC diagnostic push
@@ -44,6 +105,7 @@
 
 MANGO_DECLARE_REF_TYPE(void)
 MANGO_DECLARE_REF_TYPE(uint8_t)
+MANGO_DECLARE_REF_TYPE(int32_t)
 MANGO_DECLARE_REF_TYPE(mango_module)
 
 #pragma pack(push, 4)
@@ -108,7 +170,7 @@ typedef struct mango_vm {
   uint8_t modules_imported;
 
   uint8_t init_head;
-  uint8_t init_flags;
+  uint8_t metered;
 
   uint16_t stack_size;
   uint16_t rp;
@@ -118,7 +180,8 @@ typedef struct mango_vm {
 
   void_ref base;
 
-  uint32_t _reserved[2];
+  uint32_t fuel;
+  uint32_t heap_zeroed;
 
   union {
     void *context;
@@ -146,7 +209,7 @@ typedef struct mango_module {
   uint8_t import_count;
   uint8_t_ref imports;
 
-  uint32_t _reserved[1];
+  int32_t_ref cells;
 
   union {
     void *context;
@@ -158,6 +221,7 @@ typedef struct mango_module {
 
 MANGO_DEFINE_REF_TYPE(void, )
 MANGO_DEFINE_REF_TYPE(uint8_t, const)
+MANGO_DEFINE_REF_TYPE(int32_t, )
 MANGO_DEFINE_REF_TYPE(mango_module, )
 
 #pragma clang diagnostic pop
@@ -237,6 +301,100 @@ int mango_features(void) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+#if defined(MANGO_SIZE_CLASSES)
+
+// Heap blocks of up to 64 KiB are rounded up to a power of two of at least
+// 8 bytes. Freed blocks are kept on one list per size class. The list heads
+// sit at the start of the heap, and the first word of a free block holds
+// the offset of the next one.
+
+#define SIZE_CLASS_MIN 3
+#define SIZE_CLASS_COUNT 14
+#define SIZE_CLASS_MAX ((size_t)1 << (SIZE_CLASS_MIN + SIZE_CLASS_COUNT - 1))
+
+#define FREE_LISTS_SIZE (SIZE_CLASS_COUNT * sizeof(uint32_t))
+
+#else
+
+#define FREE_LISTS_SIZE 0
+
+#endif
+
+#if defined(MANGO_FOREIGN_SLICES)
+
+// Refs with the top bit set point into one of a few host buffers instead of
+// the VM. The next seven bits select the buffer and the low 24 bits are the
+// offset into it. The base and length of each buffer are kept in a table at
+// the start of the heap, right after the free lists (if any).
+
+#define FOREIGN_BIT 0x80000000u
+#define FOREIGN_SHIFT 24
+#define FOREIGN_REGIONS 8
+#define FOREIGN_SIZE_MAX ((uint32_t)1 << FOREIGN_SHIFT)
+
+typedef struct foreign_region {
+  uint8_t base[8];
+  uint32_t length;
+  uint32_t _reserved;
+} foreign_region;
+
+#define FOREIGN_TABLE_SIZE (FOREIGN_REGIONS * sizeof(foreign_region))
+
+#else
+
+#define FOREIGN_TABLE_SIZE 0
+
+#endif
+
+// The host's table of native syscalls (see mango_syscall_register), the
+// number of deferred syscalls (see mango_syscall_defer) and the verifier's
+// table of syscall sites (see mango_syscall_complete) come next.
+
+typedef struct syscall_table {
+  uint8_t functions[8];
+  uint32_t count;
+} syscall_table;
+
+typedef struct syscall_site {
+  uint16_t ip;
+  uint8_t module;
+  uint8_t cells;
+} syscall_site;
+
+typedef struct syscall_sites {
+  void_ref sites;
+  uint32_t count;
+} syscall_sites;
+
+#define SYSCALL_TABLE_SIZE sizeof(syscall_table)
+#define SYSCALL_TOKEN_SIZE sizeof(uint32_t)
+#define SYSCALL_SITES_SIZE sizeof(syscall_sites)
+
+// The end of the heap after the last successful import is the lowest mark
+// mango_heap_release accepts, so a release cannot give back the module table
+// or the code that linking placed on the heap.
+
+#define LINK_FLOOR_SIZE sizeof(uint32_t)
+
+// Profiling builds keep a pointer to the host's profile buffer (see
+// mango_profile_attach) after them.
+
+#if defined(MANGO_PROFILE)
+#define PROFILE_POINTER_SIZE sizeof(uint64_t)
+#else
+#define PROFILE_POINTER_SIZE 0
+#endif
+
+#define FREE_LISTS_OFFSET 0
+#define FOREIGN_TABLE_OFFSET (FREE_LISTS_OFFSET + FREE_LISTS_SIZE)
+#define SYSCALL_TABLE_OFFSET (FOREIGN_TABLE_OFFSET + FOREIGN_TABLE_SIZE)
+#define SYSCALL_TOKEN_OFFSET (SYSCALL_TABLE_OFFSET + SYSCALL_TABLE_SIZE)
+#define SYSCALL_SITES_OFFSET (SYSCALL_TOKEN_OFFSET + SYSCALL_TOKEN_SIZE)
+#define LINK_FLOOR_OFFSET (SYSCALL_SITES_OFFSET + SYSCALL_SITES_SIZE)
+#define PROFILE_POINTER_OFFSET (LINK_FLOOR_OFFSET + LINK_FLOOR_SIZE)
+
+#define HEAP_RESERVED (PROFILE_POINTER_OFFSET + PROFILE_POINTER_SIZE)
+
 mango_vm *mango_initialize(void *address, size_t heap_size, size_t stack_size,
                            void *context) {
   if (!address || ((uintptr_t)address & (__alignof(mango_vm) - 1)) != 0) {
@@ -248,7 +406,8 @@ mango_vm *mango_initialize(void *address, size_t heap_size, size_t stack_size,
   if ((stack_size & (sizeof(stackval) - 1)) != 0) {
     return NULL;
   }
-  if (heap_size < stack_size || heap_size - stack_size < sizeof(mango_vm)) {
+  if (heap_size < stack_size ||
+      heap_size - stack_size < sizeof(mango_vm) + HEAP_RESERVED) {
     return NULL;
   }
 #if SIZE_MAX > UINT32_MAX
@@ -256,17 +415,24 @@ mango_vm *mango_initialize(void *address, size_t heap_size, size_t stack_size,
     return NULL;
   }
 #endif
+#if defined(MANGO_FOREIGN_SLICES)
+  if (heap_size > FOREIGN_BIT) {
+    return NULL;
+  }
+#endif
 
   mango_vm *vm = (mango_vm *)address;
   memset(vm, 0, sizeof(mango_vm));
   vm->version = MANGO_VERSION_MAJOR;
   vm->heap_size = (uint32_t)heap_size;
-  vm->heap_used = (uint32_t)(sizeof(mango_vm) + stack_size);
+  vm->heap_used = (uint32_t)(sizeof(mango_vm) + stack_size + HEAP_RESERVED);
   vm->stack_size = (uint16_t)(stack_size / sizeof(stackval));
   vm->sp_expected = vm->sp = vm->stack_size;
   vm->sf = (stack_frame){0, 0, (uint16_t)(sizeof(mango_module_def) - 1)};
   vm->base = void_as_ref(vm, vm);
+  vm->heap_zeroed = vm->heap_size;
   vm->context = context;
+  memset((uint8_t *)address + sizeof(mango_vm) + stack_size, 0, HEAP_RESERVED);
   return vm;
 }
 
@@ -289,8 +455,8 @@ void *mango_context(const mango_vm *vm) { return vm ? vm->context : NULL; }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void *mango_heap_alloc(mango_vm *vm, size_t count, size_t size,
-                       size_t alignment, int flags) {
+static void *_mango_heap_alloc(mango_vm *vm, size_t count, size_t size,
+                               size_t alignment, int flags) {
   size_t total_size;
   size_t offset;
   size_t available;
@@ -312,13 +478,164 @@ void *mango_heap_alloc(mango_vm *vm, size_t count, size_t size,
   vm->heap_used = (uint32_t)(offset + total_size);
   void *block = (void *)((uintptr_t)vm + offset);
 
-  if ((flags & MANGO_ALLOC_ZERO_MEMORY) != 0) {
-    memset(block, 0, total_size);
+  // Memory at or above heap_zeroed has never been handed out since it was
+  // known to be zero, so only the part below needs to be cleared.
+  if ((flags & MANGO_ALLOC_ZERO_MEMORY) != 0 && offset < vm->heap_zeroed) {
+    size_t dirty = vm->heap_zeroed - offset;
+    memset(block, 0, total_size < dirty ? total_size : dirty);
+  }
+  if (vm->heap_used > vm->heap_zeroed) {
+    vm->heap_zeroed = vm->heap_used;
   }
 
   return block;
 }
 
+static inline size_t _mango_heap_base(const mango_vm *vm) {
+  return sizeof(mango_vm) + vm->stack_size * sizeof(stackval) + HEAP_RESERVED;
+}
+
+static inline void *_mango_get_reserved(const mango_vm *vm, size_t offset) {
+  return (void *)((uintptr_t)vm + _mango_heap_base(vm) - HEAP_RESERVED +
+                  offset);
+}
+
+static inline syscall_sites *_mango_get_syscall_sites(const mango_vm *vm) {
+  return (syscall_sites *)_mango_get_reserved(vm, SYSCALL_SITES_OFFSET);
+}
+
+static inline uint32_t *_mango_get_link_floor(const mango_vm *vm) {
+  return (uint32_t *)_mango_get_reserved(vm, LINK_FLOOR_OFFSET);
+}
+
+#if defined(MANGO_SIZE_CLASSES)
+
+static inline uint32_t *_mango_get_free_lists(const mango_vm *vm) {
+  return (uint32_t *)_mango_get_reserved(vm, FREE_LISTS_OFFSET);
+}
+
+static inline uint_fast8_t _mango_size_class(size_t size) {
+  return size <= ((size_t)1 << SIZE_CLASS_MIN)
+             ? 0
+             : (uint_fast8_t)(sizeof(unsigned long long) * 8 - SIZE_CLASS_MIN -
+                              (size_t)__builtin_clzll(size - 1));
+}
+
+#endif
+
+void *mango_heap_alloc(mango_vm *vm, size_t count, size_t size,
+                       size_t alignment, int flags) {
+#if defined(MANGO_SIZE_CLASSES)
+  size_t total_size;
+
+  if (!vm || __builtin_mul_overflow(count, size, &total_size)) {
+    return NULL;
+  }
+  if (total_size <= SIZE_CLASS_MAX &&
+      (alignment == 1 || alignment == 2 || alignment == 4)) {
+    uint32_t *lists = _mango_get_free_lists(vm);
+    uint_fast8_t c = _mango_size_class(total_size);
+    void *block;
+
+    if (lists[c] != 0) {
+      block = (void *)((uintptr_t)vm + lists[c]);
+      memcpy(&lists[c], block, sizeof(uint32_t));
+      if ((flags & MANGO_ALLOC_ZERO_MEMORY) != 0) {
+        memset(block, 0, total_size);
+      }
+    } else {
+      block = _mango_heap_alloc(vm, 1, (size_t)1 << (c + SIZE_CLASS_MIN),
+                                __alignof(uint32_t), flags);
+    }
+
+    return block;
+  }
+#endif
+
+  return _mango_heap_alloc(vm, count, size, alignment, flags);
+}
+
+mango_result mango_heap_free(mango_vm *vm, void *block, size_t count,
+                             size_t size) {
+#if defined(MANGO_SIZE_CLASSES)
+  size_t total_size;
+
+  if (!vm || !block) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+
+  uintptr_t offset = (uintptr_t)block - (uintptr_t)vm;
+
+  if (__builtin_mul_overflow(count, size, &total_size) ||
+      total_size > SIZE_CLASS_MAX) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  uint_fast8_t c = _mango_size_class(total_size);
+
+  if ((offset & (__alignof(uint32_t) - 1)) != 0 ||
+      offset < _mango_heap_base(vm) || offset > vm->heap_used ||
+      vm->heap_used - offset < ((size_t)1 << (c + SIZE_CLASS_MIN))) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  uint32_t *lists = _mango_get_free_lists(vm);
+  memcpy(block, &lists[c], sizeof(uint32_t));
+  lists[c] = (uint32_t)offset;
+  return MANGO_E_SUCCESS;
+#else
+  (void)vm;
+  (void)block;
+  (void)count;
+  (void)size;
+  return MANGO_E_NOT_SUPPORTED;
+#endif
+}
+
+// Hosts that hand mango_initialize memory which is known to be zero-filled,
+// e.g. from calloc or a fresh anonymous mapping, or that clear the unused
+// part of the heap themselves, can say so. Zeroed allocations above that
+// point then skip the memset.
+
+mango_result mango_heap_assume_zeroed(mango_vm *vm) {
+  if (!vm) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+
+  vm->heap_zeroed = vm->heap_used;
+  return MANGO_E_SUCCESS;
+}
+
+// A mark is the current end of the heap. Releasing it gives back everything
+// allocated since in O(1), including NEWOBJ and NEWARR memory. The VM cannot
+// find refs into the released region, so the host must only release when no
+// live object or field refers to it, e.g. between two events. Stale refs stay
+// inside the VM block and alias whatever is allocated there next: reading
+// through one returns the new object's data and writing through one corrupts
+// it. Marks taken before the last module import are rejected.
+
+size_t mango_heap_mark(const mango_vm *vm) {
+  return vm ? (size_t)vm->heap_used : 0;
+}
+
+mango_result mango_heap_release(mango_vm *vm, size_t mark) {
+  if (!vm) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+  if (mark < _mango_heap_base(vm) || mark > vm->heap_used) {
+    return MANGO_E_ARGUMENT;
+  }
+  if (mark < *_mango_get_link_floor(vm)) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+
+  vm->heap_used = (uint32_t)mark;
+#if defined(MANGO_SIZE_CLASSES)
+  memset(_mango_get_free_lists(vm), 0, FREE_LISTS_SIZE);
+#endif
+  return MANGO_E_SUCCESS;
+}
+
 size_t mango_heap_size(const mango_vm *vm) {
   return vm ? (size_t)vm->heap_size : 0;
 }
@@ -327,6 +644,84 @@ size_t mango_heap_available(const mango_vm *vm) {
   return vm ? (size_t)vm->heap_size - (size_t)vm->heap_used : 0;
 }
 
+#if defined(MANGO_FOREIGN_SLICES)
+
+static inline foreign_region *_mango_get_foreign_regions(const mango_vm *vm) {
+  return (foreign_region *)_mango_get_reserved(vm, FOREIGN_TABLE_OFFSET);
+}
+
+// Returns the `extent` bytes at a foreign ref, or NULL if they are not all
+// inside a mapped buffer.
+static void *_mango_get_foreign(const mango_vm *vm, void_ref ref,
+                                uint64_t extent) {
+  uint32_t index = (ref.address & ~FOREIGN_BIT) >> FOREIGN_SHIFT;
+  uint32_t offset = ref.address & (FOREIGN_SIZE_MAX - 1);
+
+  if (index >= FOREIGN_REGIONS) {
+    return NULL;
+  }
+
+  const foreign_region *region = &_mango_get_foreign_regions(vm)[index];
+  uint8_t *base;
+
+  if (offset + extent > region->length) {
+    return NULL;
+  }
+
+  memcpy(&base, region->base, sizeof(base));
+  return base + offset;
+}
+
+#endif
+
+// A host buffer of up to 16 MiB can be mapped into one of eight regions.
+// Programs then reach it through the returned ref address, e.g. as a slice
+// passed to them by a syscall, and every element or field access is checked
+// against the buffer. The buffer must stay valid until it is unmapped.
+
+mango_result mango_foreign_map(mango_vm *vm, int region, void *base,
+                               size_t size, uint32_t *address) {
+#if defined(MANGO_FOREIGN_SLICES)
+  if (!vm || !base || !address) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+  if (region < 0 || region >= FOREIGN_REGIONS || size > FOREIGN_SIZE_MAX) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  foreign_region *r = &_mango_get_foreign_regions(vm)[region];
+  memcpy(r->base, &base, sizeof(base));
+  r->length = (uint32_t)size;
+  *address = FOREIGN_BIT | (uint32_t)region << FOREIGN_SHIFT;
+  return MANGO_E_SUCCESS;
+#else
+  (void)vm;
+  (void)region;
+  (void)base;
+  (void)size;
+  (void)address;
+  return MANGO_E_NOT_SUPPORTED;
+#endif
+}
+
+mango_result mango_foreign_unmap(mango_vm *vm, int region) {
+#if defined(MANGO_FOREIGN_SLICES)
+  if (!vm) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+  if (region < 0 || region >= FOREIGN_REGIONS) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  memset(&_mango_get_foreign_regions(vm)[region], 0, sizeof(foreign_region));
+  return MANGO_E_SUCCESS;
+#else
+  (void)vm;
+  (void)region;
+  return MANGO_E_NOT_SUPPORTED;
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void *mango_stack_alloc(mango_vm *vm, size_t size, int flags) {
@@ -400,6 +795,20 @@ _mango_get_module_imports(const mango_vm *vm, const mango_module *module) {
   return uint8_t_as_ptr(vm, module->imports);
 }
 
+#if defined(MANGO_JIT)
+static inline const int32_t *_mango_get_module_jit(const mango_vm *vm,
+                                                   uint8_t index,
+                                                   const uint8_t **code) {
+  const mango_module *module = _mango_get_module(vm, index);
+  if (int32_t_is_null(module->cells)) {
+    return NULL;
+  }
+  const int32_t *cells = int32_t_as_ptr(vm, module->cells);
+  memcpy(code, cells - 2, sizeof(*code));
+  return cells;
+}
+#endif
+
 static inline const mango_fingerprint *
 _mango_get_module_fingerprint(const mango_vm *vm, const mango_module *module) {
   if (module->fingerprint_module == INVALID_MODULE) {
@@ -411,23 +820,68 @@ _mango_get_module_fingerprint(const mango_vm *vm, const mango_module *module) {
   }
 }
 
+// The module table is followed by an open-addressed hash index over the
+// fingerprints of all modules created so far. Each entry holds the module
+// index in the low byte and 8 more bits of the hash in the high byte, so
+// most mismatches are rejected without looking at the fingerprint.
+
+#define INDEX_EMPTY UINT16_MAX
+
+static inline uint32_t _mango_module_index_capacity(uint8_t module_count) {
+  uint32_t capacity = 4;
+  while (capacity < 2u * module_count) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+static inline uint16_t *_mango_get_module_index(const mango_vm *vm,
+                                                uint32_t *mask) {
+  mango_module *modules = _mango_get_modules(vm);
+  const mango_module_def *m = (const mango_module_def *)modules[0].image;
+  *mask = _mango_module_index_capacity(m->module_count) - 1;
+  return (uint16_t *)(modules + m->module_count);
+}
+
+static inline uint32_t _mango_hash_fingerprint(const mango_fingerprint *f) {
+  uint32_t hash = 2166136261u;
+  for (uint_fast8_t i = 0; i < sizeof(mango_fingerprint); i++) {
+    hash = (hash ^ f->bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
 static uint8_t _mango_get_or_create_module(mango_vm *vm,
                                            const mango_fingerprint *fingerprint,
                                            uint8_t fingerprint_module,
                                            uint8_t fingerprint_index) {
   mango_module *modules = _mango_get_modules(vm);
-
-  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
-    const mango_fingerprint *f = _mango_get_module_fingerprint(vm, &modules[i]);
-    if (memcmp(fingerprint, f, sizeof(mango_fingerprint)) == 0) {
-      return i;
+  uint32_t mask;
+  uint16_t *index = _mango_get_module_index(vm, &mask);
+  uint32_t hash = _mango_hash_fingerprint(fingerprint);
+  uint8_t tag = (uint8_t)(hash >> 24);
+  uint32_t i = hash & mask;
+
+  for (; index[i] != INDEX_EMPTY; i = (i + 1) & mask) {
+    if ((index[i] >> 8) == tag) {
+      const mango_module *module = &modules[index[i] & 0xFF];
+      const mango_fingerprint *f = _mango_get_module_fingerprint(vm, module);
+      if (memcmp(fingerprint, f, sizeof(mango_fingerprint)) == 0) {
+        return (uint8_t)index[i];
+      }
     }
   }
 
-  uint8_t index = vm->modules_created++;
-  modules[index].fingerprint_module = fingerprint_module;
-  modules[index].fingerprint_index = fingerprint_index;
-  return index;
+  const mango_module_def *m = (const mango_module_def *)modules[0].image;
+  if (vm->modules_created >= m->module_count) {
+    return INVALID_MODULE;
+  }
+
+  uint8_t created = vm->modules_created++;
+  modules[created].fingerprint_module = fingerprint_module;
+  modules[created].fingerprint_index = fingerprint_index;
+  index[i] = (uint16_t)(tag << 8 | created);
+  return created;
 }
 
 static mango_result _mango_initialize_module(mango_vm *vm, uint8_t index,
@@ -435,7 +889,7 @@ static mango_result _mango_initialize_module(mango_vm *vm, uint8_t index,
   const mango_module_def *m = (const mango_module_def *)(module->image);
 
   if (m->import_count != 0) {
-    uint8_t *imports = (uint8_t *)mango_heap_alloc(
+    uint8_t *imports = (uint8_t *)_mango_heap_alloc(
         vm, m->import_count, sizeof(uint8_t), __alignof(uint8_t), 0);
 
     if (!imports) {
@@ -444,6 +898,9 @@ static mango_result _mango_initialize_module(mango_vm *vm, uint8_t index,
 
     for (uint_fast8_t i = 0; i < m->import_count; i++) {
       imports[i] = _mango_get_or_create_module(vm, &m->imports[i], index, i);
+      if (imports[i] == INVALID_MODULE) {
+        return MANGO_E_BAD_IMAGE_FORMAT;
+      }
     }
 
     module->import_count = m->import_count;
@@ -453,7 +910,7 @@ static mango_result _mango_initialize_module(mango_vm *vm, uint8_t index,
     module->imports = uint8_t_null();
   }
 
-  module->_reserved[0] = 0;
+  module->cells = int32_t_null();
 
   return MANGO_E_SUCCESS;
 }
@@ -464,13 +921,23 @@ static mango_result _mango_import_startup_module(mango_vm *vm,
                                                  size_t size, void *context) {
   const mango_module_def *m = (const mango_module_def *)image;
 
-  mango_module *modules = (mango_module *)mango_heap_alloc(
-      vm, m->module_count, sizeof(mango_module), __alignof(mango_module), 0);
+  uint32_t capacity = _mango_module_index_capacity(m->module_count);
+
+  mango_module *modules = (mango_module *)_mango_heap_alloc(
+      vm, 1,
+      m->module_count * sizeof(mango_module) + capacity * sizeof(uint16_t),
+      __alignof(mango_module), 0);
 
   if (!modules) {
     return MANGO_E_OUT_OF_MEMORY;
   }
 
+  uint16_t *index = (uint16_t *)(modules + m->module_count);
+  uint32_t hash =
+      _mango_hash_fingerprint((const mango_fingerprint *)fingerprint);
+  memset(index, 0xFF, capacity * sizeof(uint16_t));
+  index[hash & (capacity - 1)] = (uint16_t)(hash >> 24 << 8);
+
   memcpy(&vm->startup_fingerprint, fingerprint, sizeof(mango_fingerprint));
   vm->modules = mango_module_as_ref(vm, modules);
   vm->modules_created = 1;
@@ -513,134 +980,3695 @@ static mango_result _mango_import_missing_module(mango_vm *vm,
   return _mango_initialize_module(vm, index, module);
 }
 
-mango_result mango_module_import(mango_vm *vm, const uint8_t *fingerprint,
-                                 const uint8_t *image, size_t size,
-                                 void *context) {
-  if (!vm || !fingerprint || !image) {
-    return MANGO_E_ARGUMENT_NULL;
-  }
-  if (size < sizeof(mango_module_def) || size > UINT16_MAX) {
-    return MANGO_E_ARGUMENT;
-  }
+#define NO_OWNER UINT16_MAX
+#define UNKNOWN_RET 255
+#define UNKNOWN_HEIGHT 256
 
-  const mango_module_def *m = (const mango_module_def *)image;
+#define SLOT_FREE 0
+#define SLOT_RESERVED 1
+#define SLOT_HEADER 2
+#define SLOT_OPERAND 3
+#define SLOT_PENDING 4
+#define SLOT_DONE 5
+#define SLOT_BLOCKED 6
+#define SLOT_LOOSE 0x80
 
-  if (m->version != MANGO_VERSION_MAJOR ||
-      m->entry_point[sizeof(m->entry_point) - 1] != HALT ||
-      m->module_count == 0 || m->import_count > m->module_count) {
-    return MANGO_E_BAD_IMAGE_FORMAT;
-  }
-  if ((m->features & mango_features()) != m->features) {
-    return MANGO_E_NOT_SUPPORTED;
+// Set in init_flags of every module once the whole graph is verified with
+// known stack heights, that is, without a CALLI or TAIL_CALLI.
+#define VERIFIED 4
+
+typedef struct opcode_info {
+  uint8_t pop;
+  uint8_t push;
+  uint8_t args;
+} opcode_info;
+
+static const opcode_info opcode_infos[256] = {
+#define OPCODE(c, s, pop, push, args, i) {pop, push, args},
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+typedef struct verify_slot {
+  uint16_t owner;
+  uint8_t height;
+  uint8_t kind;
+} verify_slot;
+
+typedef struct verify_func {
+  uint16_t offset;
+  uint8_t module;
+  uint8_t ret;
+} verify_func;
+
+typedef struct verify_item {
+  uint16_t ip;
+  uint8_t module;
+  uint8_t _reserved;
+} verify_item;
+
+typedef struct verifier {
+  mango_vm *vm;
+  uint32_t *bases;
+  verify_slot *slots;
+  verify_func *funcs;
+  verify_item *items;
+  uint32_t func_count;
+  uint32_t func_capacity;
+  uint32_t item_count;
+  uint32_t conclusive;
+} verifier;
+
+static int _mango_verify_opcode(uint8_t op) {
+  switch (op) {
+  case UNUSED31:
+  case UNUSED95:
+    return 0;
+
+  case LDLOC2_X32: // superinstructions are never accepted from images
+  case ADDLOC_I32_S:
+  case TAIL_CALL_M:
+  case CALL_M:
+  case BEQ_I32_S:
+  case BNE_I32_S:
+  case BGT_I32_S:
+  case BGT_I32_UN_S:
+  case BGE_I32_S:
+  case BGE_I32_UN_S:
+  case BLT_I32_S:
+  case BLT_I32_UN_S:
+  case BLE_I32_S:
+  case BLE_I32_UN_S:
+    return 0;
+
+  default:
+    break;
   }
 
-  if (vm->modules_imported == 0) {
-    return _mango_import_startup_module(vm, fingerprint, image, size, context);
-  } else if (vm->modules_imported < vm->modules_created) {
-    return _mango_import_missing_module(vm, fingerprint, image, size, context);
-  } else {
-    return MANGO_E_INVALID_OPERATION;
+  if (op == 0x67 ||
+      (op >= 0x89 && op <= 0x8F) || (op >= 0xB5 && op <= 0xBF) ||
+      (op >= 0xDD && op <= 0xDF) || op >= 0xFD) {
+    return 0;
   }
-}
 
-const uint8_t *mango_module_missing(const mango_vm *vm) {
-  if (!vm || vm->modules_imported >= vm->modules_created) {
-    return NULL;
+#if defined(MANGO_NO_REFS)
+  if (op == LDLOCA || (op >= 0x60 && op <= 0x8F)) {
+    return 0;
+  }
+#endif
+#if defined(MANGO_NO_I64)
+  if ((op >= 0x90 && op <= 0xBF) || op == 0xDA || op == 0xDB || op == 0xFA ||
+      op == 0xFB) {
+    return 0;
+  }
+#endif
+#if defined(MANGO_NO_F32)
+  if ((op >= 0xC0 && op <= 0xDF) || (op >= 0x77 && op <= 0x7D) ||
+      op == 0xB1 || op == 0xB2 || op == 0xFC) {
+    return 0;
+  }
+#endif
+#if defined(MANGO_NO_F64)
+  if (op >= 0xE0 || op == 0xB3 || op == 0xB4 || op == 0xDC) {
+    return 0;
   }
+#endif
 
-  mango_module *module = _mango_get_module(vm, vm->modules_imported);
-  return (const uint8_t *)_mango_get_module_fingerprint(vm, module);
+  return 1;
 }
 
-void *mango_module_context(const mango_vm *vm) {
-  if (!vm || vm->sf.module >= vm->modules_imported) {
-    return NULL;
+// Code after a CALLI is walked with an unknown stack height: its opcodes,
+// operands, branch targets and callees are checked, but nothing that depends
+// on the height. Such slots are marked SLOT_LOOSE until a walk with a known
+// height reaches them.
+static mango_result _mango_verify_visit(verifier *v, uint8_t module,
+                                        int32_t ip, uint16_t owner,
+                                        uint32_t height, uint32_t max_stack) {
+  const mango_module *m = _mango_get_module(v->vm, module);
+  verify_slot *slots = v->slots + v->bases[module];
+  int loose = height == UNKNOWN_HEIGHT;
+
+  if (ip < 0 || (uint32_t)ip >= m->image_size ||
+      (!loose && height > max_stack)) {
+    return MANGO_E_BAD_IMAGE_FORMAT;
   }
 
-  return _mango_get_module(vm, vm->sf.module)->context;
-}
+  verify_slot *slot = &slots[ip];
 
-////////////////////////////////////////////////////////////////////////////////
+  if (slot->kind == SLOT_FREE) {
+    uint8_t op = m->image[ip];
+    if (!_mango_verify_opcode(op)) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+
+    uint32_t length = 1 + (uint32_t)opcode_infos[op].args;
+    if (length > m->image_size - (uint32_t)ip) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+
+    for (uint32_t i = 1; i < length; i++) {
+      if (slot[i].kind != SLOT_FREE) {
+        return MANGO_E_BAD_IMAGE_FORMAT;
+      }
+      slot[i] = (verify_slot){owner, 0, SLOT_OPERAND};
+    }
+
+    *slot = loose ? (verify_slot){owner, 0, SLOT_PENDING | SLOT_LOOSE}
+                  : (verify_slot){owner, (uint8_t)height, SLOT_PENDING};
+    v->items[v->item_count++] = (verify_item){(uint16_t)ip, module, 0};
+    return MANGO_E_SUCCESS;
+  }
+
+  if ((slot->kind == SLOT_PENDING || slot->kind == SLOT_DONE ||
+       slot->kind == SLOT_BLOCKED) &&
+      slot->owner == owner && (loose || slot->height == height)) {
+    return MANGO_E_SUCCESS;
+  }
+
+  if ((slot->kind & SLOT_LOOSE) && slot->owner == owner) {
+    if (!loose) {
+      if (slot->kind == (SLOT_DONE | SLOT_LOOSE)) {
+        v->items[v->item_count++] = (verify_item){(uint16_t)ip, module, 0};
+      }
+      *slot = (verify_slot){owner, (uint8_t)height, SLOT_PENDING};
+    }
+    return MANGO_E_SUCCESS;
+  }
+
+  return MANGO_E_BAD_IMAGE_FORMAT;
+}
+
+static mango_result _mango_verify_function(verifier *v, uint8_t module,
+                                           uint32_t offset, uint16_t *owner) {
+  const mango_module *m = _mango_get_module(v->vm, module);
+  verify_slot *slots = v->slots + v->bases[module];
+
+  if (offset >= m->image_size ||
+      m->image_size - offset <= offsetof(mango_func_def, code)) {
+    return MANGO_E_BAD_IMAGE_FORMAT;
+  }
+  if (slots[offset].kind == SLOT_HEADER) {
+    *owner = slots[offset].owner;
+    return MANGO_E_SUCCESS;
+  }
+
+  for (uint32_t i = 0; i < offsetof(mango_func_def, code); i++) {
+    if (slots[offset + i].kind != SLOT_FREE) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+  }
+
+  const mango_func_def *f = (const mango_func_def *)(m->image + offset);
+
+  if (f->arg_count + f->loc_count > UINT8_MAX) {
+    return MANGO_E_BAD_IMAGE_FORMAT;
+  }
+  if (v->func_count == v->func_capacity) {
+    return MANGO_E_OUT_OF_MEMORY;
+  }
+
+  uint16_t id = (uint16_t)v->func_count++;
+  v->funcs[id] = (verify_func){(uint16_t)offset, module, UNKNOWN_RET};
+
+  slots[offset + 0] = (verify_slot){id, 0, SLOT_HEADER};
+  slots[offset + 1] = (verify_slot){id, 0, SLOT_OPERAND};
+  slots[offset + 2] = (verify_slot){id, 0, SLOT_OPERAND};
+
+  *owner = id;
+  return _mango_verify_visit(v, module,
+                             (int32_t)(offset + offsetof(mango_func_def, code)),
+                             id, 0, f->max_stack);
+}
+
+static mango_result _mango_verify_callee(verifier *v, uint8_t module,
+                                         const uint8_t *operands, int import,
+                                         uint16_t *owner) {
+  const mango_module *m = _mango_get_module(v->vm, module);
+  uint8_t callee = module;
+  uint16_t offset;
+
+  if (import) {
+    uint8_t index = FETCH(operands, u8);
+    if (index != INVALID_MODULE) {
+      if (index >= m->import_count) {
+        return MANGO_E_BAD_IMAGE_FORMAT;
+      }
+      callee = _mango_get_module_imports(v->vm, m)[index];
+    }
+    offset = FETCH(operands + 1, u16);
+  } else {
+    offset = FETCH(operands, u16);
+  }
+
+  return _mango_verify_function(v, callee, offset, owner);
+}
+
+static mango_result _mango_verify_step(verifier *v, uint8_t module,
+                                       uint16_t ip) {
+  const mango_module *m = _mango_get_module(v->vm, module);
+  verify_slot *slot = v->slots + v->bases[module] + ip;
+  verify_func *fn = &v->funcs[slot->owner];
+  uint16_t owner = slot->owner;
+  int loose = (slot->kind & SLOT_LOOSE) != 0;
+  uint32_t height = loose ? UNKNOWN_HEIGHT : slot->height;
+  uint32_t frame = 0;
+  uint32_t max_stack = 0;
+
+  if (fn->offset != 0) {
+    const mango_func_def *f =
+        (const mango_func_def *)(_mango_get_module(v->vm, fn->module)->image +
+                                 fn->offset);
+    frame = (uint32_t)f->arg_count + f->loc_count;
+    max_stack = f->max_stack;
+  }
+
+  const uint8_t *code = m->image + ip;
+  const opcode_info *info = &opcode_infos[code[0]];
+  int32_t next = ip + 1 + info->args;
+  mango_result result;
+  uint16_t callee;
+
+  slot->kind = loose ? SLOT_DONE | SLOT_LOOSE : SLOT_DONE;
+
+  switch (code[0]) {
+  case HALT:
+    return MANGO_E_SUCCESS;
+
+  case RET:
+  case RET_X32:
+  case RET_X64:
+    if (fn->offset == 0 || (!loose && height != info->pop)) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+    if (fn->ret == UNKNOWN_RET) {
+      fn->ret = info->pop;
+    } else if (fn->ret != info->pop) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+    return MANGO_E_SUCCESS;
+
+  case CALLI:
+    if (!loose && height < info->pop) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+    v->conclusive = 0;
+    return _mango_verify_visit(v, module, next, owner, UNKNOWN_HEIGHT,
+                               max_stack);
+
+  case TAIL_CALLI:
+    if (fn->offset == 0) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+    v->conclusive = 0;
+    return MANGO_E_SUCCESS;
+
+  case TAIL_CALL_S:
+  case TAIL_CALL:
+    if (fn->offset == 0) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+    result = _mango_verify_callee(v, module, code + 1, code[0] == TAIL_CALL,
+                                  &callee);
+    if (result != MANGO_E_SUCCESS || loose) {
+      return result;
+    }
+    do {
+      const verify_func *g = &v->funcs[callee];
+      const mango_func_def *f =
+          (const mango_func_def *)(_mango_get_module(v->vm, g->module)->image +
+                                   g->offset);
+      if (height != f->arg_count) {
+        return MANGO_E_BAD_IMAGE_FORMAT;
+      }
+      if (g->ret == UNKNOWN_RET) {
+        slot->kind = SLOT_BLOCKED;
+        return MANGO_E_SUCCESS;
+      }
+      if (fn->ret == UNKNOWN_RET) {
+        fn->ret = g->ret;
+      } else if (fn->ret != g->ret) {
+        return MANGO_E_BAD_IMAGE_FORMAT;
+      }
+    } while (0);
+    return MANGO_E_SUCCESS;
+
+  case CALL_S:
+  case CALL:
+    result =
+        _mango_verify_callee(v, module, code + 1, code[0] == CALL, &callee);
+    if (result != MANGO_E_SUCCESS) {
+      return result;
+    }
+    if (loose) {
+      break;
+    }
+    do {
+      const verify_func *g = &v->funcs[callee];
+      const mango_func_def *f =
+          (const mango_func_def *)(_mango_get_module(v->vm, g->module)->image +
+                                   g->offset);
+      if (height < f->arg_count) {
+        return MANGO_E_BAD_IMAGE_FORMAT;
+      }
+      if (g->ret == UNKNOWN_RET) {
+        slot->kind = SLOT_BLOCKED;
+        return MANGO_E_SUCCESS;
+      }
+      height = height - f->arg_count + g->ret;
+    } while (0);
+    return _mango_verify_visit(v, module, next, owner, height, max_stack);
+
+  case SYSCALL:
+    if (loose) {
+      break;
+    }
+    if ((int32_t)height < FETCH(code + 1, i8)) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+    height = (uint32_t)((int32_t)height - FETCH(code + 1, i8));
+    return _mango_verify_visit(v, module, next, owner, height, max_stack);
+
+  case LDFTN:
+    result = _mango_verify_callee(v, module, code + 1, 1, &callee);
+    if (result != MANGO_E_SUCCESS) {
+      return result;
+    }
+    break;
+
+  case LDLOC_I8:
+  case LDLOC_U8:
+  case LDLOC_I16:
+  case LDLOC_U16:
+  case LDLOC_X32:
+  case LDLOCA:
+  case STLOC_X32:
+    if (!loose && code[1] + 1u > height + frame) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+    break;
+
+  case LDLOC_X64:
+  case STLOC_X64:
+    if (!loose && code[1] + 2u > height + frame) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  if (!loose) {
+    if (height < info->pop) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+    height = height - info->pop + info->push;
+  }
+
+  switch (code[0]) {
+  case BR_S:
+    return _mango_verify_visit(v, module, next + FETCH(code + 1, i8), owner,
+                               height, max_stack);
+
+  case BR:
+    return _mango_verify_visit(v, module, next + FETCH(code + 1, i16), owner,
+                               height, max_stack);
+
+  case BRFALSE_S:
+  case BRTRUE_S:
+    result = _mango_verify_visit(v, module, next + FETCH(code + 1, i8), owner,
+                                 height, max_stack);
+    break;
+
+  case BRFALSE:
+  case BRTRUE:
+    result = _mango_verify_visit(v, module, next + FETCH(code + 1, i16), owner,
+                                 height, max_stack);
+    break;
+
+  default:
+    result = MANGO_E_SUCCESS;
+    break;
+  }
+
+  if (result != MANGO_E_SUCCESS) {
+    return result;
+  }
+
+  return _mango_verify_visit(v, module, next, owner, height, max_stack);
+}
+
+static mango_result _mango_verify_graph(verifier *v) {
+  const mango_module *modules = _mango_get_modules(v->vm);
+
+  for (uint_fast8_t i = 0; i < v->vm->modules_created; i++) {
+    const mango_module_def *m = (const mango_module_def *)modules[i].image;
+    verify_slot *slots = v->slots + v->bases[i];
+    uint32_t imports_end = (uint32_t)(sizeof(mango_module_def) +
+                                      m->import_count *
+                                          sizeof(mango_fingerprint));
+
+    for (uint32_t j = 0; j < offsetof(mango_module_def, entry_point); j++) {
+      slots[j] = (verify_slot){NO_OWNER, 0, SLOT_RESERVED};
+    }
+    for (uint32_t j = sizeof(mango_module_def); j < imports_end; j++) {
+      slots[j] = (verify_slot){NO_OWNER, 0, SLOT_RESERVED};
+    }
+
+    uint16_t id = (uint16_t)v->func_count++;
+    v->funcs[id] = (verify_func){0, (uint8_t)i, UNKNOWN_RET};
+
+    mango_result result = _mango_verify_visit(
+        v, (uint8_t)i, offsetof(mango_module_def, entry_point), id, 0, 0);
+    if (result != MANGO_E_SUCCESS) {
+      return result;
+    }
+  }
+
+  int progress;
+
+  do {
+    while (v->item_count != 0) {
+      verify_item item = v->items[--v->item_count];
+      mango_result result = _mango_verify_step(v, item.module, item.ip);
+      if (result != MANGO_E_SUCCESS) {
+        return result;
+      }
+    }
+
+    progress = 0;
+
+    for (uint_fast8_t i = 0; i < v->vm->modules_created; i++) {
+      verify_slot *slots = v->slots + v->bases[i];
+
+      for (uint32_t j = 0; j < modules[i].image_size; j++) {
+        if (slots[j].kind == SLOT_BLOCKED) {
+          mango_result result = _mango_verify_step(v, (uint8_t)i, (uint16_t)j);
+          if (result != MANGO_E_SUCCESS) {
+            return result;
+          }
+          if (slots[j].kind != SLOT_BLOCKED) {
+            progress = 1;
+          }
+        }
+      }
+    }
+  } while (progress);
+
+  return MANGO_E_SUCCESS;
+}
+
+#if defined(MANGO_SUPERINSTRUCTIONS)
+
+static int _mango_fuse_next(const verify_slot *slots, const uint8_t *image,
+                            uint32_t size, uint32_t ip, uint32_t *next) {
+  uint32_t n = ip + 1 + opcode_infos[image[ip]].args;
+
+  if (n >= size ||
+      (slots[n].kind != SLOT_DONE && slots[n].kind != SLOT_BLOCKED) ||
+      slots[n].owner != slots[ip].owner) {
+    return 0;
+  }
+
+  *next = n;
+  return 1;
+}
+
+static uint8_t _mango_fuse_compare(uint8_t compare, uint8_t branch) {
+  static const uint8_t brtrue[] = {
+      BEQ_I32_S, BNE_I32_S,    BGT_I32_S, BGT_I32_UN_S, BGE_I32_S,
+      BGE_I32_UN_S, BLT_I32_S, BLT_I32_UN_S, BLE_I32_S, BLE_I32_UN_S,
+  };
+  static const uint8_t brfalse[] = {
+      BNE_I32_S, BEQ_I32_S,    BLE_I32_S, BLE_I32_UN_S, BLT_I32_S,
+      BLT_I32_UN_S, BGE_I32_S, BGE_I32_UN_S, BGT_I32_S, BGT_I32_UN_S,
+  };
+
+  if (compare < CEQ_I32 || compare > CLE_I32_UN) {
+    return 0;
+  }
+
+  return (branch == BRTRUE_S ? brtrue : brfalse)[compare - CEQ_I32];
+}
+
+// Copies the image of a verified module into `code` and replaces the first
+// opcode of each fusable sequence with a superinstruction. The remaining
+// bytes of the sequence are left intact, so branch offsets stay valid and
+// branches into the middle of a sequence still execute the original code.
+// The copy belongs to the VM, so CALL and TAIL_CALL also have their import
+// resolved to the module index of the callee.
+static void _mango_fuse_module(const verifier *v, uint8_t module,
+                               uint8_t *code) {
+  mango_module *m = _mango_get_module(v->vm, module);
+  const verify_slot *slots = v->slots + v->bases[module];
+  const uint8_t *imports = _mango_get_module_imports(v->vm, m);
+  const uint8_t *image = m->image;
+  uint32_t size = m->image_size;
+
+  memcpy(code, image, size);
+
+  for (uint32_t ip = 0; ip < size; ip++) {
+    uint32_t ip2, ip3, ip4;
+
+    if (slots[ip].kind != SLOT_DONE && slots[ip].kind != SLOT_BLOCKED) {
+      continue;
+    }
+
+    if (image[ip] == CALL || image[ip] == TAIL_CALL) {
+      code[ip] = image[ip] == CALL ? CALL_M : TAIL_CALL_M;
+      code[ip + 1] =
+          image[ip + 1] == INVALID_MODULE ? module : imports[image[ip + 1]];
+      continue;
+    }
+
+    if (!_mango_fuse_next(slots, image, size, ip, &ip2)) {
+      continue;
+    }
+
+    if (image[ip] == LDLOC_X32 && image[ip2] == LDC_I32_S &&
+        _mango_fuse_next(slots, image, size, ip2, &ip3) &&
+        image[ip3] == ADD_I32 &&
+        _mango_fuse_next(slots, image, size, ip3, &ip4) &&
+        image[ip4] == STLOC_X32) {
+      code[ip] = ADDLOC_I32_S;
+    } else if (image[ip] == LDLOC_X32 && image[ip2] == LDLOC_X32 &&
+               image[ip2 + 1] != 0) {
+      code[ip] = LDLOC2_X32;
+    } else if (image[ip2] == BRTRUE_S || image[ip2] == BRFALSE_S) {
+      uint8_t fused = _mango_fuse_compare(image[ip], image[ip2]);
+      if (fused) {
+        code[ip] = fused;
+      }
+    }
+  }
+
+  m->image = code;
+}
+
+#endif
+
+#if defined(MANGO_JIT)
+
+// The JIT translates every instruction of a verified module graph into a
+// fixed x86-64 template. Native code keeps the evaluation stack in VM memory
+// at every instruction boundary, so it can leave at any instruction:
+// instructions without a template (calls, returns, system calls,
+// breakpoints, checked arithmetic, ...) compile to a stub that hands the
+// current position back to the interpreter, which executes them and
+// re-enters native code on the next call, return or branch.
+//
+// Templates also leave the value on top of the stack in a register when
+// they have it there anyway, and the template of the next instruction uses
+// it instead of loading it again, unless the instruction is a branch
+// target. Instructions that rely on such a register have a negative entry,
+// so the interpreter does not enter native code there.
+//
+// Register use (System V ABI):
+//   rdi  stack pointer (stackval *)
+//   rsi  VM base address, for turning refs into pointers
+//   rdx  pointer to the remaining fuel
+//   rax, rcx, r8, xmm0, xmm1  scratch; eax, rax or xmm0 may cache the top
+
+// Set on module 0 of the VM whose mango_release unmaps the native code.
+// VMs that share the code through a registry, a snapshot or a template do
+// not have it.
+#define JIT_OWNER 2
+
+typedef struct jit_exit {
+  stackval *sp;
+  uintptr_t ip;
+} jit_exit;
+
+typedef jit_exit (*jit_function)(stackval *sp, mango_vm *vm, uint32_t *fuel);
+
+typedef struct jit_assembler {
+  uint8_t *code;
+  uint32_t size;
+  uint8_t cached;   // register holding the top of stack on entry
+  uint8_t produced; // register holding the top of stack on exit
+} jit_assembler;
+
+#define JIT_CACHE_NONE 0
+#define JIT_CACHE_EAX 1  // dword [rdi]
+#define JIT_CACHE_RAX 2  // qword [rdi]
+#define JIT_CACHE_XMM0 3 // qword [rdi]
+
+#define JIT_ALWAYS 0xFF
+
+#define JIT_CC_B 0x2
+#define JIT_CC_AE 0x3
+#define JIT_CC_E 0x4
+#define JIT_CC_NE 0x5
+#define JIT_CC_BE 0x6
+#define JIT_CC_A 0x7
+#define JIT_CC_P 0xA
+#define JIT_CC_NP 0xB
+#define JIT_CC_L 0xC
+#define JIT_CC_GE 0xD
+#define JIT_CC_LE 0xE
+#define JIT_CC_G 0xF
+
+#define JIT_EXIT_SIZE 9
+
+static void _mango_jit_byte(jit_assembler *a, uint8_t value) {
+  if (a->code) {
+    a->code[a->size] = value;
+  }
+  a->size++;
+}
+
+static void _mango_jit_u32(jit_assembler *a, uint32_t value) {
+  for (uint_fast8_t i = 0; i < 4; i++) {
+    _mango_jit_byte(a, (uint8_t)(value >> (8 * i)));
+  }
+}
+
+// Emits up to four prefix, REX and opcode bytes packed into `op`,
+// most significant byte first, with leading zero bytes omitted.
+static void _mango_jit_opcode(jit_assembler *a, uint32_t op) {
+  int started = 0;
+  for (int_fast8_t shift = 24; shift >= 0; shift -= 8) {
+    uint8_t value = (uint8_t)(op >> shift);
+    if (started || value != 0 || shift == 0) {
+      _mango_jit_byte(a, value);
+      started = 1;
+    }
+  }
+}
+
+// Emits `opcode reg, [rdi + disp]`.
+static void _mango_jit_mem(jit_assembler *a, uint32_t op, uint8_t reg,
+                           int32_t disp) {
+  _mango_jit_opcode(a, op);
+  if (disp == 0) {
+    _mango_jit_byte(a, (uint8_t)(reg << 3 | 7));
+  } else if (disp >= INT8_MIN && disp <= INT8_MAX) {
+    _mango_jit_byte(a, (uint8_t)(0x40 | reg << 3 | 7));
+    _mango_jit_byte(a, (uint8_t)disp);
+  } else {
+    _mango_jit_byte(a, (uint8_t)(0x80 | reg << 3 | 7));
+    _mango_jit_u32(a, (uint32_t)disp);
+  }
+}
+
+static void _mango_jit_adjust(jit_assembler *a, int32_t delta) {
+  if (delta != 0) {
+    _mango_jit_mem(a, 0x488D, 7, delta); // lea rdi, [rdi + delta]
+  }
+}
+
+// Emits `mov eax, [rdi]` unless eax already holds the top of stack.
+static void _mango_jit_top(jit_assembler *a) {
+  if (a->cached != JIT_CACHE_EAX) {
+    _mango_jit_mem(a, 0x8B, 0, 0);
+  }
+}
+
+// Emits `movsd xmm0, [rdi]` unless rax or xmm0 already hold the top of
+// stack.
+static void _mango_jit_top_f64(jit_assembler *a) {
+  if (a->cached == JIT_CACHE_RAX) {
+    _mango_jit_opcode(a, 0x66480F6E); // movq xmm0, rax
+    _mango_jit_byte(a, 0xC0);
+  } else if (a->cached != JIT_CACHE_XMM0) {
+    _mango_jit_mem(a, 0xF20F10, 0, 0);
+  }
+}
+
+static void _mango_jit_exit(jit_assembler *a, uint32_t ip, int32_t delta) {
+  _mango_jit_adjust(a, delta);
+  _mango_jit_opcode(a, 0x4889F8); // mov rax, rdi
+  _mango_jit_byte(a, 0xBA);       // mov edx, ip
+  _mango_jit_u32(a, ip);
+  _mango_jit_byte(a, 0xC3); // ret
+}
+
+static void _mango_jit_rel32(jit_assembler *a, const int32_t *entries,
+                             uint32_t target) {
+  int32_t entry = entries[target] < 0 ? -entries[target] : entries[target];
+  _mango_jit_u32(a, (uint32_t)entry - (a->size + 4));
+}
+
+// Emits a jump to the instruction at `target` if condition `cc` holds. Taken
+// backward jumps are charged like in the interpreter; when the fuel runs out,
+// native code leaves at the branch with the stack pointer restored by `delta`
+// so the interpreter can take the branch and time out.
+static void _mango_jit_branch(jit_assembler *a, const int32_t *entries,
+                              uint32_t ip, uint32_t target, uint8_t cc,
+                              int32_t delta, int backward) {
+  if (!backward) {
+    _mango_jit_opcode(a, cc == JIT_ALWAYS ? 0xE9 : 0x0F80U | cc);
+    _mango_jit_rel32(a, entries, target);
+    return;
+  }
+
+  uint8_t stub = (uint8_t)(JIT_EXIT_SIZE + (delta != 0 ? 4 : 0));
+  if (cc != JIT_ALWAYS) {
+    _mango_jit_byte(a, (uint8_t)(0x70 | (cc ^ 1)));
+    _mango_jit_byte(a, (uint8_t)(3 + 2 + stub + 2 + 5));
+  }
+  _mango_jit_opcode(a, 0x833A00); // cmp dword [rdx], 0
+  _mango_jit_byte(a, 0x75);       // jne
+  _mango_jit_byte(a, stub);
+  _mango_jit_exit(a, ip, delta);
+  _mango_jit_opcode(a, 0xFF0A); // dec dword [rdx]
+  _mango_jit_byte(a, 0xE9);     // jmp
+  _mango_jit_rel32(a, entries, target);
+}
+
+#if !defined(MANGO_NO_REFS) && !defined(MANGO_FOREIGN_SLICES)
+
+// Emits `opcode reg, [rcx + rax * scale]`.
+static void _mango_jit_element(jit_assembler *a, uint32_t op, uint8_t reg,
+                               uint8_t scale) {
+  static const uint8_t scales[] = {0, 0x00, 0x40, 0, 0x80, 0, 0, 0, 0xC0};
+  _mango_jit_opcode(a, op);
+  _mango_jit_byte(a, (uint8_t)(reg << 3 | 4));
+  _mango_jit_byte(a, (uint8_t)(scales[scale] | 0 << 3 | 1));
+}
+
+// Emits a bounds check of the index in eax against the length at
+// [rdi + disp] that leaves native code at `ip` if it fails.
+static void _mango_jit_bounds(jit_assembler *a, uint32_t ip, int32_t disp) {
+  _mango_jit_mem(a, 0x3B, 0, disp); // cmp eax, [rdi + disp]
+  _mango_jit_byte(a, 0x72);         // jb
+  _mango_jit_byte(a, JIT_EXIT_SIZE);
+  _mango_jit_exit(a, ip, 0);
+}
+
+#endif
+
+static void _mango_jit_setcc(jit_assembler *a, uint8_t cc, uint8_t cc2,
+                             uint8_t combine) {
+  _mango_jit_opcode(a, 0x0F90C0U | (uint32_t)cc << 8); // setcc al
+  if (combine != 0) {
+    _mango_jit_opcode(a, 0x0F90C1U | (uint32_t)cc2 << 8); // setcc cl
+    _mango_jit_opcode(a, combine == 1 ? 0x20C8 : 0x08C8); // and/or al, cl
+  }
+  _mango_jit_opcode(a, 0x0FB6C0); // movzx eax, al
+}
+
+#if !defined(MANGO_NO_F32) || !defined(MANGO_NO_F64)
+
+typedef struct jit_compare {
+  uint8_t reversed;
+  uint8_t cc;
+  uint8_t cc2;
+  uint8_t combine;
+} jit_compare;
+
+// Maps CEQ ... CLE_UN to `ucomis` flag tests. Operands are compared as
+// (value1, value2), or as (value2, value1) if `reversed` is set.
+static const jit_compare jit_float_compares[] = {
+    {0, JIT_CC_E, JIT_CC_NP, 1},  {0, JIT_CC_E, 0, 0},
+    {0, JIT_CC_NE, JIT_CC_NP, 1}, {0, JIT_CC_NE, JIT_CC_P, 2},
+    {0, JIT_CC_A, 0, 0},          {1, JIT_CC_B, 0, 0},
+    {0, JIT_CC_AE, 0, 0},         {1, JIT_CC_BE, 0, 0},
+    {1, JIT_CC_A, 0, 0},          {0, JIT_CC_B, 0, 0},
+    {1, JIT_CC_AE, 0, 0},         {0, JIT_CC_BE, 0, 0},
+};
+
+static void _mango_jit_float_compare(jit_assembler *a, uint32_t load,
+                                     uint32_t compare, int32_t width,
+                                     const jit_compare *c) {
+  if (c->reversed && width == 8) {
+    _mango_jit_top_f64(a);
+  } else {
+    _mango_jit_mem(a, load, 0, c->reversed ? 0 : width);
+  }
+  _mango_jit_mem(a, compare, 0, c->reversed ? width : 0);
+  _mango_jit_setcc(a, c->cc, c->cc2, c->combine);
+  _mango_jit_mem(a, 0x89, 0, 2 * width - 4);
+  _mango_jit_adjust(a, 2 * width - 4);
+  a->produced = JIT_CACHE_EAX;
+}
+
+#endif
+
+// Emits the template for the instruction at `ip`. Returns 1 if execution
+// can continue with the following instruction, 0 if not, or -1 if the
+// instruction has no template.
+static int _mango_jit_instruction(jit_assembler *a, const int32_t *entries,
+                                  const uint8_t *image, uint32_t ip) {
+  static const uint8_t compare_i32[] = {
+      JIT_CC_E, JIT_CC_NE, JIT_CC_G,  JIT_CC_A,  JIT_CC_GE,
+      JIT_CC_AE, JIT_CC_L, JIT_CC_B, JIT_CC_LE, JIT_CC_BE,
+  };
+
+  const uint8_t *p = image + ip;
+  uint32_t next = ip + 1 + opcode_infos[*p].args;
+
+  switch (*p) {
+  case NOP:
+    return 1;
+
+  case SWAP:
+    if (a->cached == JIT_CACHE_EAX) {
+      _mango_jit_opcode(a, 0x89C1); // mov ecx, eax
+    } else {
+      _mango_jit_mem(a, 0x8B, 1, 0);
+    }
+    _mango_jit_mem(a, 0x8B, 0, 4);
+    _mango_jit_mem(a, 0x89, 0, 0);
+    _mango_jit_mem(a, 0x89, 1, 4);
+    a->produced = JIT_CACHE_EAX;
+    return 1;
+
+  case POP_X32:
+    _mango_jit_adjust(a, 4);
+    return 1;
+
+  case POP_X64:
+    _mango_jit_adjust(a, 8);
+    return 1;
+
+  case DUP_X32:
+    _mango_jit_top(a);
+    _mango_jit_adjust(a, -4);
+    _mango_jit_mem(a, 0x89, 0, 0);
+    a->produced = JIT_CACHE_EAX;
+    return 1;
+
+  case DUP_X64:
+    if (a->cached != JIT_CACHE_RAX) {
+      _mango_jit_mem(a, 0x488B, 0, 0);
+    }
+    _mango_jit_adjust(a, -8);
+    _mango_jit_mem(a, 0x4889, 0, 0);
+    a->produced = JIT_CACHE_RAX;
+    return 1;
+
+  case OVER:
+    _mango_jit_mem(a, 0x8B, 0, 4);
+    _mango_jit_adjust(a, -4);
+    _mango_jit_mem(a, 0x89, 0, 0);
+    a->produced = JIT_CACHE_EAX;
+    return 1;
+
+  case NIP:
+    _mango_jit_top(a);
+    _mango_jit_mem(a, 0x89, 0, 4);
+    _mango_jit_adjust(a, 4);
+    a->produced = JIT_CACHE_EAX;
+    return 1;
+
+  case LDLOC_I8:
+  case LDLOC_U8:
+  case LDLOC_I16:
+  case LDLOC_U16:
+  case LDLOC_X32: {
+    static const uint32_t loads[] = {0x0FBE, 0x0FB6, 0x0FBF, 0x0FB7, 0x8B};
+    _mango_jit_mem(a, loads[*p - LDLOC_I8], 0, p[1] * 4);
+    _mango_jit_adjust(a, -4);
+    _mango_jit_mem(a, 0x89, 0, 0);
+    a->produced = JIT_CACHE_EAX;
+    return 1;
+  }
+
+  case LDLOC_X64:
+    _mango_jit_mem(a, 0x488B, 0, p[1] * 4);
+    _mango_jit_adjust(a, -8);
+    _mango_jit_mem(a, 0x4889, 0, 0);
+    a->produced = JIT_CACHE_RAX;
+    return 1;
+
+#if !defined(MANGO_NO_REFS)
+  case LDLOCA:
+    _mango_jit_mem(a, 0x488D, 0, p[1] * 4);
+    _mango_jit_opcode(a, 0x4829F0); // sub rax, rsi
+    _mango_jit_adjust(a, -4);
+    _mango_jit_mem(a, 0x89, 0, 0);
+    a->produced = JIT_CACHE_EAX;
+    return 1;
+#endif
+
+  case STLOC_X32:
+    _mango_jit_top(a);
+    _mango_jit_mem(a, 0x89, 0, p[1] * 4);
+    _mango_jit_adjust(a, 4);
+    return 1;
+
+  case STLOC_X64:
+    if (a->cached == JIT_CACHE_XMM0) {
+      _mango_jit_mem(a, 0xF20F11, 0, p[1] * 4);
+    } else {
+      if (a->cached != JIT_CACHE_RAX) {
+        _mango_jit_mem(a, 0x488B, 0, 0);
+      }
+      _mango_jit_mem(a, 0x4889, 0, p[1] * 4);
+    }
+    _mango_jit_adjust(a, 8);
+    return 1;
+
+  case BR_S:
+  case BR: {
+    int32_t offset = *p == BR_S ? FETCH(p + 1, i8) : FETCH(p + 1, i16);
+    _mango_jit_branch(a, entries, ip, (uint32_t)((int32_t)next + offset),
+                      JIT_ALWAYS, 0, offset < 0);
+    return 0;
+  }
+
+  case BRFALSE_S:
+  case BRTRUE_S:
+  case BRFALSE:
+  case BRTRUE: {
+    int short_form = *p == BRFALSE_S || *p == BRTRUE_S;
+    int32_t offset = short_form ? FETCH(p + 1, i8) : FETCH(p + 1, i16);
+    if (a->cached == JIT_CACHE_EAX) {
+      _mango_jit_opcode(a, 0x85C0); // test eax, eax
+    } else {
+      _mango_jit_opcode(a, 0x833F00); // cmp dword [rdi], 0
+    }
+    _mango_jit_adjust(a, 4);
+    _mango_jit_branch(a, entries, ip, (uint32_t)((int32_t)next + offset),
+                      *p == BRFALSE_S || *p == BRFALSE ? JIT_CC_E : JIT_CC_NE,
+                      -4, offset < 0);
+    return 1;
+  }
+
+  case LDC_I32_M1:
+  case LDC_I32_0:
+  case LDC_I32_1:
+  case LDC_I32_2:
+  case LDC_I32_3:
+  case LDC_I32_4:
+  case LDC_I32_5:
+  case LDC_I32_6:
+  case LDC_I32_7:
+  case LDC_I32_8:
+  case LDC_I32_S:
+  case LDC_X32: {
+    uint32_t value = *p == LDC_X32     ? FETCH(p + 1, u32)
+                     : *p == LDC_I32_S ? (uint32_t)FETCH(p + 1, i8)
+                                       : (uint32_t)(*p - LDC_I32_0);
+    _mango_jit_byte(a, 0xB8); // mov eax, imm32
+    _mango_jit_u32(a, value);
+    _mango_jit_adjust(a, -4);
+    _mango_jit_mem(a, 0x89, 0, 0);
+    a->produced = JIT_CACHE_EAX;
+    return 1;
+  }
+
+  case LDC_X64:
+    _mango_jit_opcode(a, 0x48B8); // mov rax, imm64
+    _mango_jit_u32(a, FETCH(p + 1, u32));
+    _mango_jit_u32(a, FETCH(p + 5, u32));
+    _mango_jit_adjust(a, -8);
+    _mango_jit_mem(a, 0x4889, 0, 0);
+    a->produced = JIT_CACHE_RAX;
+    return 1;
+
+  case LDLOC2_X32:
+    _mango_jit_mem(a, 0x8B, 1, p[1] * 4);
+    _mango_jit_mem(a, 0x8B, 0, (p[3] - 1) * 4);
+    _mango_jit_adjust(a, -8);
+    _mango_jit_mem(a, 0x89, 0, 0);
+    _mango_jit_mem(a, 0x89, 1, 4);
+    a->produced = JIT_CACHE_EAX;
+    return 1;
+
+  case ADDLOC_I32_S:
+    _mango_jit_mem(a, 0x8B, 0, p[1] * 4);
+    _mango_jit_opcode(a, 0x83C0); // add eax, imm8
+    _mango_jit_byte(a, p[3]);
+    _mango_jit_mem(a, 0x89, 0, (p[6] - 1) * 4);
+    return 1;
+
+  case BEQ_I32_S:
+  case BNE_I32_S:
+  case BGT_I32_S:
+  case BGT_I32_UN_S:
+  case BGE_I32_S:
+  case BGE_I32_UN_S:
+  case BLT_I32_S:
+  case BLT_I32_UN_S:
+  case BLE_I32_S:
+  case BLE_I32_UN_S: {
+    uint8_t cc = *p >= BLE_I32_S ? compare_i32[8 + *p - BLE_I32_S]
+                                 : compare_i32[*p - BEQ_I32_S];
+    int32_t offset = FETCH(p + 2, i8);
+    if (a->cached == JIT_CACHE_EAX) {
+      _mango_jit_mem(a, 0x39, 0, 4); // cmp [rdi + 4], eax
+    } else {
+      _mango_jit_mem(a, 0x8B, 0, 4);
+      _mango_jit_mem(a, 0x3B, 0, 0);
+    }
+    _mango_jit_adjust(a, 8);
+    _mango_jit_branch(a, entries, ip, (uint32_t)((int32_t)next + offset), cc,
+                      -8, offset < 0);
+    return 1;
+  }
+
+  case ADD_I32:
+  case SUB_I32:
+  case MUL_I32:
+  case AND_I32:
+  case OR_I32:
+  case XOR_I32: {
+    uint32_t op = *p == ADD_I32   ? 0x03
+                  : *p == SUB_I32 ? 0x2B
+                  : *p == MUL_I32 ? 0x0FAF
+                  : *p == AND_I32 ? 0x23
+                  : *p == OR_I32  ? 0x0B
+                                  : 0x33;
+    if (a->cached != JIT_CACHE_EAX) {
+      _mango_jit_mem(a, 0x8B, 0, 4);
+      _mango_jit_mem(a, op, 0, 0);
+    } else if (*p == SUB_I32) {
+      _mango_jit_opcode(a, 0xF7D8); // neg eax
+      _mango_jit_mem(a, 0x03, 0, 4);
+    } else {
+      _mango_jit_mem(a, op, 0, 4);
+    }
+    _mango_jit_mem(a, 0x89, 0, 4);
+    _mango_jit_adjust(a, 4);
+    a->produced = JIT_CACHE_EAX;
+    return 1;
+  }
+
+  case NEG_I32:
+    _mango_jit_mem(a, 0xF7, 3, 0);
+    return 1;
+
+  case NOT_I32:
+    _mango_jit_mem(a, 0xF7, 2, 0);
+    return 1;
+
+  case SHL_I32:
+  case SHR_I32:
+  case SHR_I32_UN:
+    _mango_jit_mem(a, 0x8B, 1, 0);
+    _mango_jit_mem(a, 0xD3, *p == SHL_I32 ? 4 : *p == SHR_I32 ? 7 : 5, 4);
+    _mango_jit_adjust(a, 4);
+    return 1;
+
+  case CEQ_I32:
+  case CNE_I32:
+  case CGT_I32:
+  case CGT_I32_UN:
+  case CGE_I32:
+  case CGE_I32_UN:
+  case CLT_I32:
+  case CLT_I32_UN:
+  case CLE_I32:
+  case CLE_I32_UN:
+    if (a->cached == JIT_CACHE_EAX) {
+      _mango_jit_mem(a, 0x39, 0, 4); // cmp [rdi + 4], eax
+    } else {
+      _mango_jit_mem(a, 0x8B, 0, 4);
+      _mango_jit_mem(a, 0x3B, 0, 0);
+    }
+    _mango_jit_setcc(a, compare_i32[*p - CEQ_I32], 0, 0);
+    _mango_jit_mem(a, 0x89, 0, 4);
+    _mango_jit_adjust(a, 4);
+    a->produced = JIT_CACHE_EAX;
+    return 1;
+
+  case CONV_I8_I32:
+  case CONV_U8_I32:
+  case CONV_I16_I32:
+  case CONV_U16_I32: {
+    static const uint32_t loads[] = {0x0FBE, 0x0FB6, 0x0FBF, 0x0FB7};
+    _mango_jit_mem(a, loads[*p - CONV_I8_I32], 0, 0);
+    _mango_jit_mem(a, 0x89, 0, 0);
+    a->produced = JIT_CACHE_EAX;
+    return 1;
+  }
+
+#if !defined(MANGO_NO_REFS) && !defined(MANGO_FOREIGN_SLICES)
+  case LDELEM_I8:
+  case LDELEM_U8:
+  case LDELEM_I16:
+  case LDELEM_U16:
+  case LDELEM_X32:
+  case LDELEM_X64: {
+    static const uint32_t loads[] = {0x0FBE, 0x0FB6, 0x0FBF,
+                                     0x0FB7, 0x8B,   0x488B};
+    static const uint8_t scales[] = {1, 1, 2, 2, 4, 8};
+    _mango_jit_top(a);
+    _mango_jit_bounds(a, ip, 8);
+    _mango_jit_mem(a, 0x8B, 1, 4);
+    _mango_jit_opcode(a, 0x4801F1); // add rcx, rsi
+    _mango_jit_element(a, loads[*p - LDELEM_I8], 0, scales[*p - LDELEM_I8]);
+    if (*p == LDELEM_X64) {
+      _mango_jit_adjust(a, 4);
+      _mango_jit_mem(a, 0x4889, 0, 0);
+      a->produced = JIT_CACHE_RAX;
+    } else {
+      _mango_jit_adjust(a, 8);
+      _mango_jit_mem(a, 0x89, 0, 0);
+      a->produced = JIT_CACHE_EAX;
+    }
+    return 1;
+  }
+
+  case STELEM_X8:
+  case STELEM_X16:
+  case STELEM_X32:
+  case STELEM_X64: {
+    static const uint32_t stores[] = {0x4488, 0x664489, 0x4489, 0x4C89};
+    static const uint8_t scales[] = {1, 2, 4, 8};
+    int32_t width = *p == STELEM_X64 ? 8 : 4;
+    _mango_jit_mem(a, 0x8B, 0, width);
+    _mango_jit_bounds(a, ip, width + 8);
+    _mango_jit_mem(a, 0x8B, 1, width + 4);
+    _mango_jit_opcode(a, 0x4801F1); // add rcx, rsi
+    _mango_jit_mem(a, *p == STELEM_X64 ? 0x4C8B : 0x448B, 0, 0);
+    _mango_jit_element(a, stores[*p - STELEM_X8], 0, scales[*p - STELEM_X8]);
+    _mango_jit_adjust(a, width + 12);
+    return 1;
+  }
+#endif
+
+#if !defined(MANGO_NO_I64)
+  case ADD_I64:
+  case SUB_I64:
+  case MUL_I64:
+  case AND_I64:
+  case OR_I64:
+  case XOR_I64: {
+    uint32_t op = *p == ADD_I64   ? 0x4803
+                  : *p == SUB_I64 ? 0x482B
+                  : *p == MUL_I64 ? 0x480FAF
+                  : *p == AND_I64 ? 0x4823
+                  : *p == OR_I64  ? 0x480B
+                                  : 0x4833;
+    _mango_jit_mem(a, 0x488B, 0, 8);
+    _mango_jit_mem(a, op, 0, 0);
+    _mango_jit_mem(a, 0x4889, 0, 8);
+    _mango_jit_adjust(a, 8);
+    a->produced = JIT_CACHE_RAX;
+    return 1;
+  }
+
+  case NEG_I64:
+    _mango_jit_mem(a, 0x48F7, 3, 0);
+    return 1;
+
+  case NOT_I64:
+    _mango_jit_mem(a, 0x48F7, 2, 0);
+    return 1;
+
+  case SHL_I64:
+  case SHR_I64:
+  case SHR_I64_UN:
+    _mango_jit_mem(a, 0x8B, 1, 0);
+    _mango_jit_mem(a, 0x48D3, *p == SHL_I64 ? 4 : *p == SHR_I64 ? 7 : 5, 4);
+    _mango_jit_adjust(a, 4);
+    return 1;
+
+  case CEQ_I64:
+  case CNE_I64:
+  case CGT_I64:
+  case CGT_I64_UN:
+  case CGE_I64:
+  case CGE_I64_UN:
+  case CLT_I64:
+  case CLT_I64_UN:
+  case CLE_I64:
+  case CLE_I64_UN:
+    _mango_jit_mem(a, 0x488B, 0, 8);
+    _mango_jit_mem(a, 0x483B, 0, 0);
+    _mango_jit_setcc(a, compare_i32[*p - CEQ_I64], 0, 0);
+    _mango_jit_mem(a, 0x89, 0, 12);
+    _mango_jit_adjust(a, 12);
+    a->produced = JIT_CACHE_EAX;
+    return 1;
+
+  case CONV_I32_I64:
+  case CONV_U32_I64:
+    _mango_jit_mem(a, 0x8B, 0, 0);
+    _mango_jit_adjust(a, 4);
+    _mango_jit_mem(a, 0x89, 0, 0);
+    return 1;
+
+  case CONV_I64_I32:
+  case CONV_U64_I32:
+    _mango_jit_mem(a, *p == CONV_I64_I32 ? 0x4863 : 0x8B, 0, 0);
+    _mango_jit_adjust(a, -4);
+    _mango_jit_mem(a, 0x4889, 0, 0);
+    return 1;
+#endif
+
+#if !defined(MANGO_NO_F32)
+  case ADD_F32:
+  case SUB_F32:
+  case MUL_F32:
+  case DIV_F32: {
+    static const uint32_t ops[] = {0xF30F58, 0xF30F5C, 0xF30F59, 0xF30F5E};
+    _mango_jit_mem(a, 0xF30F10, 0, 4);
+    _mango_jit_mem(a, ops[*p - ADD_F32], 0, 0);
+    _mango_jit_mem(a, 0xF30F11, 0, 4);
+    _mango_jit_adjust(a, 4);
+    return 1;
+  }
+
+  case NEG_F32:
+    _mango_jit_mem(a, 0x80, 6, 3); // xor byte [rdi + 3], 0x80
+    _mango_jit_byte(a, 0x80);
+    return 1;
+
+  case CEQ_F32:
+  case CEQ_F32_UN:
+  case CNE_F32:
+  case CNE_F32_UN:
+  case CGT_F32:
+  case CGT_F32_UN:
+  case CGE_F32:
+  case CGE_F32_UN:
+  case CLT_F32:
+  case CLT_F32_UN:
+  case CLE_F32:
+  case CLE_F32_UN:
+    _mango_jit_float_compare(a, 0xF30F10, 0x0F2E, 4,
+                             &jit_float_compares[*p - CEQ_F32]);
+    return 1;
+
+  case CONV_I32_F32:
+    _mango_jit_mem(a, 0xF30F2C, 0, 0);
+    _mango_jit_mem(a, 0x89, 0, 0);
+    return 1;
+
+  case CONV_F32_I32:
+    _mango_jit_mem(a, 0xF30F2A, 0, 0);
+    _mango_jit_mem(a, 0xF30F11, 0, 0);
+    return 1;
+#endif
+
+#if !defined(MANGO_NO_F64)
+  case ADD_F64:
+  case SUB_F64:
+  case MUL_F64:
+  case DIV_F64: {
+    static const uint32_t ops[] = {0xF20F58, 0xF20F5C, 0xF20F59, 0xF20F5E};
+    if (a->cached == JIT_CACHE_RAX || a->cached == JIT_CACHE_XMM0) {
+      _mango_jit_opcode(a, a->cached == JIT_CACHE_RAX
+                               ? 0x66480F6E  // movq xmm1, rax
+                               : 0x660F28); // movapd xmm1, xmm0
+      _mango_jit_byte(a, 0xC8);
+      _mango_jit_mem(a, 0xF20F10, 0, 8);
+      _mango_jit_opcode(a, ops[*p - ADD_F64]); // op xmm0, xmm1
+      _mango_jit_byte(a, 0xC1);
+    } else {
+      _mango_jit_mem(a, 0xF20F10, 0, 8);
+      _mango_jit_mem(a, ops[*p - ADD_F64], 0, 0);
+    }
+    _mango_jit_mem(a, 0xF20F11, 0, 8);
+    _mango_jit_adjust(a, 8);
+    a->produced = JIT_CACHE_XMM0;
+    return 1;
+  }
+
+  case NEG_F64:
+    _mango_jit_mem(a, 0x80, 6, 7); // xor byte [rdi + 7], 0x80
+    _mango_jit_byte(a, 0x80);
+    return 1;
+
+  case CEQ_F64:
+  case CEQ_F64_UN:
+  case CNE_F64:
+  case CNE_F64_UN:
+  case CGT_F64:
+  case CGT_F64_UN:
+  case CGE_F64:
+  case CGE_F64_UN:
+  case CLT_F64:
+  case CLT_F64_UN:
+  case CLE_F64:
+  case CLE_F64_UN:
+    _mango_jit_float_compare(a, 0xF20F10, 0x660F2E, 8,
+                             &jit_float_compares[*p - CEQ_F64]);
+    return 1;
+
+  case CONV_I32_F64:
+    _mango_jit_mem(a, 0xF20F2C, 0, 0);
+    _mango_jit_adjust(a, 4);
+    _mango_jit_mem(a, 0x89, 0, 0);
+    return 1;
+
+  case CONV_F64_I32:
+    _mango_jit_mem(a, 0xF20F2A, 0, 0);
+    _mango_jit_adjust(a, -4);
+    _mango_jit_mem(a, 0xF20F11, 0, 0);
+    return 1;
+
+#if !defined(MANGO_NO_F32)
+  case CONV_F32_F64:
+    _mango_jit_mem(a, 0xF20F5A, 0, 0);
+    _mango_jit_adjust(a, 4);
+    _mango_jit_mem(a, 0xF30F11, 0, 0);
+    return 1;
+
+  case CONV_F64_F32:
+    _mango_jit_mem(a, 0xF30F5A, 0, 0);
+    _mango_jit_adjust(a, -4);
+    _mango_jit_mem(a, 0xF20F11, 0, 0);
+    return 1;
+#endif
+#endif
+
+  default:
+    return -1;
+  }
+}
+
+// Marks the targets of all branches in a module. Native code only jumps
+// there with the evaluation stack in memory, so they must not rely on a
+// cached top of stack.
+static void _mango_jit_targets(const verifier *v, uint8_t module,
+                               uint8_t *targets) {
+  const mango_module *m = _mango_get_module(v->vm, module);
+  const verify_slot *slots = v->slots + v->bases[module];
+  const uint8_t *image = m->image;
+
+  for (uint32_t ip = 0; ip < m->image_size; ip++) {
+    const uint8_t *p = image + ip;
+    uint32_t next = ip + 1 + opcode_infos[*p].args;
+
+    if (slots[ip].kind != SLOT_DONE && slots[ip].kind != SLOT_BLOCKED) {
+      continue;
+    }
+
+    switch (*p) {
+    case BR_S:
+    case BRFALSE_S:
+    case BRTRUE_S:
+      targets[(int32_t)next + FETCH(p + 1, i8)] = 1;
+      break;
+    case BR:
+    case BRFALSE:
+    case BRTRUE:
+      targets[(int32_t)next + FETCH(p + 1, i16)] = 1;
+      break;
+    case BEQ_I32_S:
+    case BNE_I32_S:
+    case BGT_I32_S:
+    case BGT_I32_UN_S:
+    case BGE_I32_S:
+    case BGE_I32_UN_S:
+    case BLT_I32_S:
+    case BLT_I32_UN_S:
+    case BLE_I32_S:
+    case BLE_I32_UN_S:
+      targets[(int32_t)next + FETCH(p + 2, i8)] = 1;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+static void _mango_jit_module(jit_assembler *a, const verifier *v,
+                              uint8_t module, int32_t *entries,
+                              uint8_t *targets) {
+  const mango_module *m = _mango_get_module(v->vm, module);
+  const verify_slot *slots = v->slots + v->bases[module];
+  const uint8_t *image = m->image;
+  uint32_t size = m->image_size;
+
+  a->cached = JIT_CACHE_NONE;
+
+  for (uint32_t ip = 0; ip < size; ip++) {
+    entries[ip] = 0;
+
+    if (slots[ip].kind != SLOT_DONE && slots[ip].kind != SLOT_BLOCKED) {
+      continue;
+    }
+
+    if (targets[ip]) {
+      a->cached = JIT_CACHE_NONE;
+    }
+    entries[ip] = a->cached != JIT_CACHE_NONE ? -(int32_t)a->size
+                                              : (int32_t)a->size;
+    a->produced = JIT_CACHE_NONE;
+
+    int next = _mango_jit_instruction(a, entries, image, ip);
+    a->cached = next > 0 ? a->produced : JIT_CACHE_NONE;
+    if (next < 0) {
+      entries[ip] = -(int32_t)a->size;
+      _mango_jit_exit(a, ip, 0);
+    } else if (next > 0) {
+      // Superinstructions cover several instructions, each of which has
+      // its own entry, so continue explicitly after the whole sequence.
+      uint32_t following = ip + 1 + opcode_infos[image[ip]].args;
+      uint32_t n = ip + 1;
+      while (n < size && slots[n].kind != SLOT_DONE &&
+             slots[n].kind != SLOT_BLOCKED) {
+        n++;
+      }
+      if (n != following) {
+        _mango_jit_byte(a, 0xE9); // jmp
+        _mango_jit_rel32(a, entries, following);
+        targets[following] = 1;
+        a->cached = JIT_CACHE_NONE;
+      }
+    }
+  }
+}
+
+// Compiles all modules into a single mapping. The first pass only computes
+// the code size and the entry of each instruction; the second pass emits the
+// code. Both passes produce the same layout, because every template has a
+// size that depends only on the instruction it translates and on the
+// register its predecessor left the top of stack in. The branch targets are
+// scratch memory on the heap, which the caller releases. The mapping starts
+// with its size, so no entry is ever at offset 0, and belongs to the VM that
+// compiled it until mango_release.
+static int _mango_jit_compile(const verifier *v, int32_t *cells) {
+  mango_vm *vm = v->vm;
+  jit_assembler a;
+  int32_t *entries;
+  uint32_t total_size = 0;
+
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    total_size += _mango_get_module(vm, (uint8_t)i)->image_size;
+  }
+
+  uint8_t *targets = (uint8_t *)_mango_heap_alloc(
+      vm, total_size, sizeof(uint8_t), __alignof(uint8_t),
+      MANGO_ALLOC_ZERO_MEMORY);
+  if (!targets) {
+    return 0;
+  }
+
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    _mango_jit_targets(v, (uint8_t)i, targets + v->bases[i]);
+  }
+
+  a.code = NULL;
+  a.size = sizeof(uint32_t);
+  entries = cells;
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    entries += 2;
+    _mango_jit_module(&a, v, (uint8_t)i, entries, targets + v->bases[i]);
+    entries += _mango_get_module(vm, (uint8_t)i)->image_size;
+  }
+
+  uint32_t size = a.size;
+  if (size > INT32_MAX) {
+    return 0;
+  }
+
+  uint8_t *code = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    return 0;
+  }
+
+  memcpy(code, &size, sizeof(size));
+  a.code = code;
+  a.size = sizeof(uint32_t);
+  entries = cells;
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    memcpy(entries, &code, sizeof(code));
+    entries += 2;
+    _mango_jit_module(&a, v, (uint8_t)i, entries, targets + v->bases[i]);
+    _mango_get_module(vm, (uint8_t)i)->cells = int32_t_as_ref(vm, entries);
+    entries += _mango_get_module(vm, (uint8_t)i)->image_size;
+  }
+
+  if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, size);
+    for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+      _mango_get_module(vm, (uint8_t)i)->cells = int32_t_null();
+    }
+    return 0;
+  }
+
+  _mango_get_module(vm, 0)->init_flags |= JIT_OWNER;
+  return 1;
+}
+
+#endif
+
+// The verifier knows the height of the evaluation stack at every SYSCALL it
+// reached, so it lists how many cells the stack holds after each one, by
+// module and offset. A deferred syscall cannot complete with more results.
+
+static uint32_t _mango_list_syscalls(const verifier *v, syscall_site *sites) {
+  uint32_t count = 0;
+
+  for (uint_fast8_t i = 0; i < v->vm->modules_created; i++) {
+    const mango_module *m = _mango_get_module(v->vm, (uint8_t)i);
+    const verify_slot *slots = v->slots + v->bases[i];
+
+    for (uint32_t ip = 0; ip < m->image_size; ip++) {
+      if (slots[ip].kind == SLOT_DONE && m->image[ip] == SYSCALL) {
+        if (sites) {
+          int32_t cells = slots[ip].height - FETCH(m->image + ip + 1, i8);
+          sites[count] = (syscall_site){(uint16_t)ip, (uint8_t)i,
+                                        (uint8_t)cells};
+        }
+        count++;
+      }
+    }
+  }
+
+  return count;
+}
+
+static mango_result _mango_verify_modules(mango_vm *vm) {
+  const mango_module *modules = _mango_get_modules(vm);
+  uint32_t total_size = 0;
+
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    total_size += modules[i].image_size;
+  }
+
+  uint32_t func_capacity = total_size / 4 + vm->modules_created;
+  if (func_capacity > NO_OWNER) {
+    func_capacity = NO_OWNER;
+  }
+
+  uint32_t heap_used = vm->heap_used;
+  mango_result result = MANGO_E_OUT_OF_MEMORY;
+
+#if defined(MANGO_SUPERINSTRUCTIONS)
+  uint8_t *code = (uint8_t *)_mango_heap_alloc(
+      vm, total_size, sizeof(uint8_t), __alignof(uint8_t), 0);
+  uint32_t code_used = vm->heap_used;
+#endif
+
+#if defined(MANGO_JIT)
+  int32_t *cells = (int32_t *)_mango_heap_alloc(
+      vm, total_size + 2 * vm->modules_created, sizeof(int32_t),
+      __alignof(int32_t), MANGO_ALLOC_ZERO_MEMORY);
+  uint32_t cells_used = vm->heap_used;
+#endif
+
+  verifier v;
+  v.vm = vm;
+  v.bases = (uint32_t *)_mango_heap_alloc(vm, vm->modules_created,
+                                          sizeof(uint32_t),
+                                          __alignof(uint32_t), 0);
+  v.slots = (verify_slot *)_mango_heap_alloc(
+      vm, total_size, sizeof(verify_slot), __alignof(verify_slot),
+      MANGO_ALLOC_ZERO_MEMORY);
+  v.funcs = (verify_func *)_mango_heap_alloc(vm, func_capacity,
+                                             sizeof(verify_func),
+                                             __alignof(verify_func), 0);
+  v.items = (verify_item *)_mango_heap_alloc(
+      vm, total_size, sizeof(verify_item), __alignof(verify_item), 0);
+  v.func_count = 0;
+  v.func_capacity = func_capacity;
+  v.item_count = 0;
+  v.conclusive = 1;
+
+  if (v.bases && v.slots && v.funcs && v.items) {
+    uint32_t base = 0;
+
+    for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+      v.bases[i] = base;
+      base += modules[i].image_size;
+    }
+
+    result = _mango_verify_graph(&v);
+  }
+
+  // The site list is built after the scratch memory and moved down below.
+  uint32_t site_count = 0;
+  syscall_site *sites = NULL;
+
+  if (result == MANGO_E_SUCCESS) {
+    site_count = _mango_list_syscalls(&v, NULL);
+    sites = (syscall_site *)_mango_heap_alloc(vm, site_count,
+                                              sizeof(syscall_site),
+                                              __alignof(syscall_site), 0);
+    if (sites) {
+      _mango_list_syscalls(&v, sites);
+    } else {
+      result = MANGO_E_OUT_OF_MEMORY;
+    }
+  }
+
+#if defined(MANGO_SUPERINSTRUCTIONS)
+  if (result == MANGO_E_SUCCESS && code) {
+    for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+      _mango_fuse_module(&v, (uint8_t)i, code + v.bases[i]);
+    }
+    heap_used = code_used;
+  }
+#endif
+
+  if (result == MANGO_E_SUCCESS && v.conclusive) {
+    for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+      _mango_get_module(vm, (uint8_t)i)->init_flags |= VERIFIED;
+    }
+  }
+
+#if defined(MANGO_JIT)
+  if (result == MANGO_E_SUCCESS && v.conclusive && cells &&
+      _mango_jit_compile(&v, cells)) {
+    heap_used = cells_used;
+  }
+#endif
+
+  vm->heap_used = heap_used;
+
+  if (result == MANGO_E_SUCCESS) {
+    syscall_sites *t = _mango_get_syscall_sites(vm);
+    void *block = _mango_heap_alloc(vm, site_count, sizeof(syscall_site),
+                                    __alignof(syscall_site), 0);
+    memmove(block, sites, site_count * sizeof(syscall_site));
+    t->sites = void_as_ref(vm, block);
+    t->count = site_count;
+  }
+
+  return result;
+}
+
+mango_result mango_module_import(mango_vm *vm, const uint8_t *fingerprint,
+                                 const uint8_t *image, size_t size,
+                                 void *context) {
+  if (!vm || !fingerprint || !image) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+  if (size < sizeof(mango_module_def) || size > UINT16_MAX) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  const mango_module_def *m = (const mango_module_def *)image;
+
+  if (m->version != MANGO_VERSION_MAJOR ||
+      m->entry_point[sizeof(m->entry_point) - 1] != HALT ||
+      m->module_count == 0 || m->import_count > m->module_count ||
+      size < sizeof(mango_module_def) +
+                 m->import_count * sizeof(mango_fingerprint)) {
+    return MANGO_E_BAD_IMAGE_FORMAT;
+  }
+  if ((m->features & mango_features()) != m->features) {
+    return MANGO_E_NOT_SUPPORTED;
+  }
+
+  mango_result result;
+
+  if (vm->modules_imported == 0) {
+    result =
+        _mango_import_startup_module(vm, fingerprint, image, size, context);
+  } else if (vm->modules_imported < vm->modules_created) {
+    result =
+        _mango_import_missing_module(vm, fingerprint, image, size, context);
+  } else {
+    return MANGO_E_INVALID_OPERATION;
+  }
+
+  if (result == MANGO_E_SUCCESS &&
+      vm->modules_imported == vm->modules_created) {
+    result = _mango_verify_modules(vm);
+    if (result != MANGO_E_SUCCESS) {
+      vm->result = (uint8_t)result;
+    }
+  }
+
+  if (result == MANGO_E_SUCCESS) {
+    *_mango_get_link_floor(vm) = vm->heap_used;
+  }
+
+  return result;
+}
+
+// Imports the startup module from the first entry (unless the VM already has
+// one) and then every missing module from the entry with its fingerprint.
+// Modules are linked in the same order as by a mango_module_missing loop, so
+// their import tables end up next to each other on the heap.
+mango_result mango_module_import_all(mango_vm *vm,
+                                     const mango_module_image *images,
+                                     size_t count) {
+  if (!vm || !images) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+  if (count == 0) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  mango_result result;
+  const uint8_t *fingerprint;
+
+  if (vm->modules_imported == 0) {
+    result = mango_module_import(vm, images[0].fingerprint, images[0].image,
+                                 images[0].size, images[0].context);
+    if (result != MANGO_E_SUCCESS) {
+      return result;
+    }
+  }
+
+  while ((fingerprint = mango_module_missing(vm)) != NULL) {
+    const mango_module_image *entry = NULL;
+
+    for (size_t i = 0; i < count; i++) {
+      if (images[i].fingerprint &&
+          memcmp(images[i].fingerprint, fingerprint,
+                 sizeof(mango_fingerprint)) == 0) {
+        entry = &images[i];
+        break;
+      }
+    }
+
+    if (!entry) {
+      return MANGO_E_ARGUMENT;
+    }
+
+    result = mango_module_import(vm, entry->fingerprint, entry->image,
+                                 entry->size, entry->context);
+    if (result != MANGO_E_SUCCESS) {
+      return result;
+    }
+  }
+
+  return MANGO_E_SUCCESS;
+}
+
+const uint8_t *mango_module_missing(const mango_vm *vm) {
+  if (!vm || vm->modules_imported >= vm->modules_created) {
+    return NULL;
+  }
+
+  mango_module *module = _mango_get_module(vm, vm->modules_imported);
+  return (const uint8_t *)_mango_get_module_fingerprint(vm, module);
+}
+
+int mango_module_verified(const mango_vm *vm) {
+  if (!vm || vm->modules_imported == 0 ||
+      vm->modules_imported != vm->modules_created) {
+    return 0;
+  }
+
+  return (_mango_get_module(vm, 0)->init_flags & VERIFIED) != 0;
+}
+
+void *mango_module_context(const mango_vm *vm) {
+  if (!vm || vm->sf.module >= vm->modules_imported) {
+    return NULL;
+  }
+
+  return _mango_get_module(vm, vm->sf.module)->context;
+}
+
+// A registry is a VM without a stack that links and verifies a module graph
+// once. Importing it into a fresh VM copies the module table, the import
+// tables, the syscall sites and the native entry cells, because the VM
+// reaches them through refs into its own heap; images, fused code and native
+// code stay in the registry, which must therefore outlive and not change
+// under the VMs that use it.
+
+mango_registry *mango_registry_initialize(void *address, size_t size) {
+  return (mango_registry *)mango_initialize(address, size, 0, NULL);
+}
+
+mango_result mango_registry_import(mango_registry *registry,
+                                   const uint8_t *fingerprint,
+                                   const uint8_t *image, size_t size,
+                                   void *context) {
+  return mango_module_import((mango_vm *)registry, fingerprint, image, size,
+                             context);
+}
+
+const uint8_t *mango_registry_missing(const mango_registry *registry) {
+  return mango_module_missing((const mango_vm *)registry);
+}
+
+mango_result mango_module_import_registry(mango_vm *vm,
+                                          const mango_registry *registry) {
+  const mango_vm *r = (const mango_vm *)registry;
+
+  if (!vm || !r) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+  if (vm->modules_imported != 0 || r->modules_imported == 0 ||
+      r->modules_imported < r->modules_created ||
+      r->result != MANGO_E_SUCCESS) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+
+  const mango_module *modules_r = _mango_get_modules(r);
+  const mango_module_def *m = (const mango_module_def *)modules_r[0].image;
+  size_t table_size =
+      m->module_count * sizeof(mango_module) +
+      _mango_module_index_capacity(m->module_count) * sizeof(uint16_t);
+  size_t import_count = 0;
+
+  for (uint_fast8_t i = 0; i < r->modules_created; i++) {
+    import_count += modules_r[i].import_count;
+  }
+
+  uint32_t heap_used = vm->heap_used;
+  mango_module *modules = (mango_module *)_mango_heap_alloc(
+      vm, 1, table_size, __alignof(mango_module), 0);
+  uint8_t *imports = (uint8_t *)_mango_heap_alloc(
+      vm, import_count, sizeof(uint8_t), __alignof(uint8_t), 0);
+  const syscall_sites *sites_r = _mango_get_syscall_sites(r);
+  syscall_site *sites = (syscall_site *)_mango_heap_alloc(
+      vm, sites_r->count, sizeof(syscall_site), __alignof(syscall_site), 0);
+
+  if (!modules || !imports || !sites) {
+    vm->heap_used = heap_used;
+    return MANGO_E_OUT_OF_MEMORY;
+  }
+
+  memcpy(modules, modules_r, table_size);
+  memcpy(sites, void_as_ptr(r, sites_r->sites),
+         sites_r->count * sizeof(syscall_site));
+  _mango_get_syscall_sites(vm)->sites = void_as_ref(vm, sites);
+  _mango_get_syscall_sites(vm)->count = sites_r->count;
+
+  for (uint_fast8_t i = 0; i < r->modules_created; i++) {
+    mango_module *module = &modules[i];
+
+    if (module->import_count != 0) {
+      memcpy(imports, uint8_t_as_ptr(r, module->imports), module->import_count);
+      module->imports = uint8_t_as_ref(vm, imports);
+      imports += module->import_count;
+    }
+
+    module->cells = int32_t_null();
+
+#if defined(MANGO_JIT)
+    module->init_flags &= (uint8_t)~JIT_OWNER;
+    if (!int32_t_is_null(modules_r[i].cells)) {
+      int32_t *cells = (int32_t *)_mango_heap_alloc(
+          vm, module->image_size + 2u, sizeof(int32_t), __alignof(int32_t), 0);
+      if (!cells) {
+        vm->heap_used = heap_used;
+        return MANGO_E_OUT_OF_MEMORY;
+      }
+      memcpy(cells, int32_t_as_ptr(r, modules_r[i].cells) - 2,
+             (module->image_size + 2u) * sizeof(int32_t));
+      module->cells = int32_t_as_ref(vm, cells + 2);
+    }
+#endif
+  }
+
+  memcpy(&vm->startup_fingerprint, &r->startup_fingerprint,
+         sizeof(mango_fingerprint));
+  vm->modules = mango_module_as_ref(vm, modules);
+  vm->modules_created = r->modules_created;
+  vm->modules_imported = r->modules_imported;
+  *_mango_get_link_floor(vm) = vm->heap_used;
+
+  return MANGO_E_SUCCESS;
+}
+
+// A snapshot is a byte copy of the used part of a VM, so it holds the heap,
+// the stack and the module table. The copy records the address of the VM it
+// was taken from in place of the VM context. On restore, module images that
+// point into that VM (fused code) move with the copy; all other images and
+// module contexts are passed through the host's rebase function, if any.
+// Native code and dispatch caches are shared with the process, so snapshots
+// can only be restored in the process that took them.
+
+static void _mango_rebase_snapshot(mango_vm *vm, void *context,
+                                   mango_rebase_func rebase, void *state) {
+  uintptr_t origin = (uintptr_t)vm->context;
+  vm->context = context;
+
+  for (uint_fast8_t i = 0; i < vm->modules_imported; i++) {
+    mango_module *module = _mango_get_module(vm, (uint8_t)i);
+    uintptr_t offset = (uintptr_t)module->image - origin;
+
+    if (offset < vm->heap_used) {
+      module->image = (const uint8_t *)vm + offset;
+    } else if (rebase) {
+      module->image = (const uint8_t *)rebase(state, module->image);
+    }
+    if (rebase && module->context) {
+      module->context = rebase(state, module->context);
+    }
+#if defined(MANGO_JIT)
+    module->init_flags &= (uint8_t)~JIT_OWNER;
+#endif
+  }
+
+  syscall_table *t = (syscall_table *)_mango_get_reserved(vm,
+                                                          SYSCALL_TABLE_OFFSET);
+  void *functions;
+  memcpy(&functions, t->functions, sizeof(functions));
+  if (rebase && functions) {
+    functions = rebase(state, functions);
+    memcpy(t->functions, &functions, sizeof(functions));
+  }
+
+#if defined(MANGO_FOREIGN_SLICES)
+  // Host buffers do not carry over; the host maps them again if needed.
+  memset(_mango_get_foreign_regions(vm), 0, FOREIGN_TABLE_SIZE);
+#endif
+
+#if defined(MANGO_PROFILE)
+  // Neither does the profile buffer.
+  memset(_mango_get_reserved(vm, PROFILE_POINTER_OFFSET), 0,
+         PROFILE_POINTER_SIZE);
+#endif
+}
+
+size_t mango_snapshot_size(const mango_vm *vm) {
+  return vm ? vm->heap_used : 0;
+}
+
+mango_result mango_snapshot(const mango_vm *vm, void *address, size_t size) {
+  if (!vm || !address) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+  if (size < vm->heap_used) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  memcpy(address, vm, vm->heap_used);
+  memcpy((uint8_t *)address + offsetof(mango_vm, context), &vm, sizeof(vm));
+  return MANGO_E_SUCCESS;
+}
+
+mango_vm *mango_restore(void *address, size_t heap_size, const void *snapshot,
+                        size_t size, void *context, mango_rebase_func rebase,
+                        void *state) {
+  mango_vm header;
+
+  if (!address || ((uintptr_t)address & (__alignof(mango_vm) - 1)) != 0) {
+    return NULL;
+  }
+  if (!snapshot || size < sizeof(mango_vm)) {
+    return NULL;
+  }
+
+  memcpy(&header, snapshot, sizeof(mango_vm));
+
+  if (header.version != MANGO_VERSION_MAJOR || header.heap_used > size ||
+      header.heap_used < sizeof(mango_vm) || heap_size < header.heap_used) {
+    return NULL;
+  }
+#if SIZE_MAX > UINT32_MAX
+  if (heap_size > UINT32_MAX) {
+    return NULL;
+  }
+#endif
+#if defined(MANGO_FOREIGN_SLICES)
+  if (heap_size > FOREIGN_BIT) {
+    return NULL;
+  }
+#endif
+
+  mango_vm *vm = (mango_vm *)address;
+  memcpy(vm, snapshot, header.heap_used);
+
+  // Refs are absolute pointers on 32-bit hosts and cannot move.
+  if (void_as_ptr(vm, vm->base) != vm) {
+    return NULL;
+  }
+
+  vm->heap_size = (uint32_t)heap_size;
+  vm->heap_zeroed = vm->heap_size;
+  _mango_rebase_snapshot(vm, context, rebase, state);
+  return vm;
+}
+
+// Templates put a snapshot into a sealed memfd that is as large as the heap.
+// Every clone is a private mapping of it, so clones share all pages they do
+// not write to and cost the same to create regardless of the heap size.
+
+int mango_template_create(const mango_vm *vm) {
+#if defined(__linux__)
+  if (!vm) {
+    return -1;
+  }
+
+  int fd = memfd_create("mango", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (ftruncate(fd, vm->heap_size) == 0) {
+    void *address = mmap(NULL, vm->heap_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+    if (address != MAP_FAILED) {
+      mango_result result = mango_snapshot(vm, address, vm->heap_size);
+      munmap(address, vm->heap_size);
+      if (result == MANGO_E_SUCCESS &&
+          fcntl(fd, F_ADD_SEALS,
+                F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) ==
+              0) {
+        return fd;
+      }
+    }
+  }
+
+  close(fd);
+  return -1;
+#else
+  (void)vm;
+  return -1;
+#endif
+}
+
+mango_vm *mango_template_clone(int fd, void *context, mango_rebase_func rebase,
+                               void *state) {
+#if defined(__linux__)
+  mango_vm header;
+
+  if (pread(fd, &header, sizeof(mango_vm), 0) != sizeof(mango_vm) ||
+      header.version != MANGO_VERSION_MAJOR) {
+    return NULL;
+  }
+
+  mango_vm *vm = (mango_vm *)mmap(NULL, header.heap_size,
+                                  PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (vm == MAP_FAILED) {
+    return NULL;
+  }
+
+  if (void_as_ptr(vm, vm->base) != vm) {
+    munmap(vm, header.heap_size);
+    return NULL;
+  }
+
+  vm->heap_zeroed = vm->heap_used;
+  _mango_rebase_snapshot(vm, context, rebase, state);
+  return vm;
+#else
+  (void)fd;
+  (void)context;
+  (void)rebase;
+  (void)state;
+  return NULL;
+#endif
+}
+
+void mango_template_release(mango_vm *vm) {
+#if defined(__linux__)
+  if (vm) {
+    munmap(vm, vm->heap_size);
+  }
+#else
+  (void)vm;
+#endif
+}
+
+// Releases what a VM holds outside its heap, which is the native code the
+// JIT compiled when the VM linked its modules. The VM keeps running in the
+// interpreter. VMs that share the code, because they were imported from the
+// VM as a registry, restored from its snapshots or cloned from its
+// templates, must not run afterwards.
+
+void mango_release(mango_vm *vm) {
+#if defined(MANGO_JIT)
+  if (!vm || vm->modules_created == 0 ||
+      (_mango_get_module(vm, 0)->init_flags & JIT_OWNER) == 0) {
+    return;
+  }
+
+  const uint8_t *code = NULL;
+  uint32_t size;
+  if (!_mango_get_module_jit(vm, 0, &code)) {
+    return;
+  }
+  memcpy(&size, code, sizeof(size));
+  munmap((void *)(uintptr_t)code, size);
+
+  for (uint_fast8_t i = 0; i < vm->modules_created; i++) {
+    _mango_get_module(vm, (uint8_t)i)->cells = int32_t_null();
+  }
+  _mango_get_module(vm, 0)->init_flags &= (uint8_t)~JIT_OWNER;
+#else
+  (void)vm;
+#endif
+}
+
+void mango_registry_release(mango_registry *registry) {
+  mango_release((mango_vm *)registry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The optimizer rewrites the module images of a program into equivalent but
+// smaller images. It follows the control flow from the entry point of every
+// module, so code that can never run is dropped, and then
+//   - loads every i32 constant with the shortest instruction,
+//   - folds i32 arithmetic on constants unless the result takes more space,
+//   - removes values that are pushed and popped right away,
+//   - removes branches to the next instruction,
+//   - calls functions of the same module with CALL_S or TAIL_CALL_S, and
+//   - uses the short form of every branch whose target is in range.
+// Functions move, so the images of all modules of a program are rewritten
+// together and calls and function pointers into every module are updated.
+// No instruction gets longer, so no image grows. Images are not verified;
+// importing them into a VM does that, before and after optimization.
+// The optimizer is an offline tool and only built with MANGO_OPTIMIZER (see
+// tools/mango-opt.c); without it, mango_optimize returns NOT_SUPPORTED.
+
+#if defined(MANGO_OPTIMIZER)
+
+#define OPT_START 0x01
+#define OPT_OPERAND 0x02
+#define OPT_FUNCTION 0x04
+#define OPT_TARGET 0x08
+
+#define OPT_NONE UINT32_MAX
+
+typedef struct optimize_insn {
+  uint32_t value;    // constant, branch target or module << 16 | callee
+  uint32_t previous; // last kept instruction falling through to this one
+  uint16_t offset;   // in the image
+  uint16_t address;  // in the optimized image
+  uint8_t opcode;
+  uint8_t size; // in the optimized image; 0 if removed
+  uint8_t flags;
+  uint8_t _reserved;
+} optimize_insn;
+
+typedef struct optimize_module {
+  const uint8_t *image;
+  uint8_t *flags;
+  uint16_t *map;
+  optimize_insn *insns;
+  uint32_t size;
+  uint32_t header;
+  uint32_t count;
+  uint32_t optimized_size;
+} optimize_module;
+
+typedef struct optimize_item {
+  uint16_t offset;
+  uint8_t module;
+  uint8_t _reserved;
+} optimize_item;
+
+typedef struct optimizer {
+  const mango_module_image *images;
+  optimize_module *modules;
+  optimize_item *items;
+  uint32_t item_count;
+  uint32_t module_count;
+} optimizer;
+
+static void *_mango_optimize_carve(uintptr_t *cursor, size_t count,
+                                   size_t size, size_t alignment) {
+  uintptr_t address = (*cursor + (alignment - 1)) & ~(uintptr_t)(alignment - 1);
+  *cursor = address + count * size;
+  return (void *)address;
+}
+
+static int _mango_optimize_visit(optimizer *o, uint8_t module,
+                                 int32_t offset) {
+  optimize_module *m = &o->modules[module];
+
+  if (offset < 0 || (uint32_t)offset >= m->size) {
+    return 0;
+  }
+  if (m->flags[offset] & OPT_START) {
+    return 1;
+  }
+  if (m->flags[offset] != 0) {
+    return 0;
+  }
+
+  m->flags[offset] = OPT_START;
+  o->items[o->item_count++] = (optimize_item){(uint16_t)offset, module, 0};
+  return 1;
+}
+
+static int _mango_optimize_target(optimizer *o, uint8_t module,
+                                  int32_t offset) {
+  if (!_mango_optimize_visit(o, module, offset)) {
+    return 0;
+  }
+  o->modules[module].flags[offset] |= OPT_TARGET;
+  return 1;
+}
+
+static int _mango_optimize_function(optimizer *o, int module,
+                                    uint32_t offset) {
+  if (module < 0) {
+    return 0;
+  }
+
+  optimize_module *m = &o->modules[module];
+  uint32_t code = offset + offsetof(mango_func_def, code);
+
+  if (offset >= m->size || m->size - offset <= offsetof(mango_func_def, code)) {
+    return 0;
+  }
+  if (m->flags[offset] & OPT_FUNCTION) {
+    return 1;
+  }
+  for (uint32_t i = offset; i < code; i++) {
+    if (m->flags[i] != 0) {
+      return 0;
+    }
+    m->flags[i] = OPT_OPERAND;
+  }
+
+  m->flags[offset] = OPT_FUNCTION;
+  return _mango_optimize_target(o, (uint8_t)module, (int32_t)code);
+}
+
+static int _mango_optimize_callee(const optimizer *o, uint8_t module,
+                                  uint8_t import) {
+  const mango_module_def *m =
+      (const mango_module_def *)o->modules[module].image;
+
+  if (import == INVALID_MODULE) {
+    return module;
+  }
+  if (import >= m->import_count) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < o->module_count; i++) {
+    if (o->images[i].fingerprint &&
+        memcmp(o->images[i].fingerprint, &m->imports[import],
+               sizeof(mango_fingerprint)) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+static mango_result _mango_optimize_step(optimizer *o, optimize_item item) {
+  optimize_module *m = &o->modules[item.module];
+  const uint8_t *code = m->image + item.offset;
+  uint32_t length = 1 + (uint32_t)opcode_infos[code[0]].args;
+  int32_t next = item.offset + (int32_t)length;
+  int result;
+
+  if (!_mango_verify_opcode(code[0]) || length > m->size - item.offset) {
+    return MANGO_E_BAD_IMAGE_FORMAT;
+  }
+  for (uint32_t i = 1; i < length; i++) {
+    if (m->flags[item.offset + i] != 0) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+    m->flags[item.offset + i] = OPT_OPERAND;
+  }
+
+  switch (code[0]) {
+  case HALT:
+  case RET:
+  case RET_X32:
+  case RET_X64:
+  case TAIL_CALLI:
+    return MANGO_E_SUCCESS;
+
+  case TAIL_CALL_S:
+    result = _mango_optimize_function(o, item.module, FETCH(code + 1, u16));
+    return result ? MANGO_E_SUCCESS : MANGO_E_BAD_IMAGE_FORMAT;
+
+  case TAIL_CALL:
+    result = _mango_optimize_function(
+        o, _mango_optimize_callee(o, item.module, code[1]),
+        FETCH(code + 2, u16));
+    return result ? MANGO_E_SUCCESS : MANGO_E_BAD_IMAGE_FORMAT;
+
+  case BR_S:
+    result = _mango_optimize_target(o, item.module, next + FETCH(code + 1, i8));
+    return result ? MANGO_E_SUCCESS : MANGO_E_BAD_IMAGE_FORMAT;
+
+  case BR:
+    result =
+        _mango_optimize_target(o, item.module, next + FETCH(code + 1, i16));
+    return result ? MANGO_E_SUCCESS : MANGO_E_BAD_IMAGE_FORMAT;
+
+  case BRFALSE_S:
+  case BRTRUE_S:
+    result = _mango_optimize_target(o, item.module, next + FETCH(code + 1, i8));
+    break;
+
+  case BRFALSE:
+  case BRTRUE:
+    result =
+        _mango_optimize_target(o, item.module, next + FETCH(code + 1, i16));
+    break;
+
+  case CALL_S:
+    result = _mango_optimize_function(o, item.module, FETCH(code + 1, u16));
+    break;
+
+  case CALL:
+  case LDFTN:
+    result = _mango_optimize_function(
+        o, _mango_optimize_callee(o, item.module, code[1]),
+        FETCH(code + 2, u16));
+    break;
+
+  default:
+    result = 1;
+    break;
+  }
+
+  if (!result || !_mango_optimize_visit(o, item.module, next)) {
+    return MANGO_E_BAD_IMAGE_FORMAT;
+  }
+  return MANGO_E_SUCCESS;
+}
+
+static int _mango_optimize_is_constant(const optimize_insn *insn) {
+  return (insn->flags & OPT_FUNCTION) == 0 && insn->opcode >= LDC_I32_M1 &&
+         insn->opcode <= LDC_X32;
+}
+
+static int _mango_optimize_is_branch(const optimize_insn *insn) {
+  return (insn->flags & OPT_FUNCTION) == 0 && insn->opcode >= BR_S &&
+         insn->opcode <= BRTRUE;
+}
+
+static uint8_t _mango_optimize_constant_size(uint32_t value) {
+  int32_t v = (int32_t)value;
+  return v >= -1 && v <= 8 ? 1 : v >= INT8_MIN && v <= INT8_MAX ? 2 : 5;
+}
+
+static void _mango_optimize_constant(optimize_insn *insn, uint32_t value) {
+  insn->value = value;
+  insn->size = _mango_optimize_constant_size(value);
+  insn->opcode = insn->size == 1   ? (uint8_t)(LDC_I32_0 + (int32_t)value)
+                 : insn->size == 2 ? LDC_I32_S
+                                   : LDC_X32;
+}
+
+// Computes value1 op value2 the way the interpreter does, unless it traps.
+
+static int _mango_optimize_fold(uint8_t op, uint32_t value1, uint32_t value2,
+                                uint32_t *result) {
+  int32_t a = (int32_t)value1;
+  int32_t b = (int32_t)value2;
+
+  switch (op) {
+  case ADD_I32:
+    *result = value1 + value2;
+    return 1;
+  case SUB_I32:
+    *result = value1 - value2;
+    return 1;
+  case MUL_I32:
+    *result = value1 * value2;
+    return 1;
+  case DIV_I32:
+  case REM_I32:
+    if (b == 0 || (b == -1 && a == INT32_MIN)) {
+      return 0;
+    }
+    *result = (uint32_t)(op == DIV_I32 ? a / b : a % b);
+    return 1;
+  case DIV_I32_UN:
+  case REM_I32_UN:
+    if (value2 == 0) {
+      return 0;
+    }
+    *result = op == DIV_I32_UN ? value1 / value2 : value1 % value2;
+    return 1;
+  case SHL_I32:
+    *result = value1 << (value2 & 31);
+    return 1;
+  case SHR_I32:
+    *result = (uint32_t)(a >> (value2 & 31));
+    return 1;
+  case SHR_I32_UN:
+    *result = value1 >> (value2 & 31);
+    return 1;
+  case AND_I32:
+    *result = value1 & value2;
+    return 1;
+  case OR_I32:
+    *result = value1 | value2;
+    return 1;
+  case XOR_I32:
+    *result = value1 ^ value2;
+    return 1;
+  case CEQ_I32:
+    *result = value1 == value2;
+    return 1;
+  case CNE_I32:
+    *result = value1 != value2;
+    return 1;
+  case CGT_I32:
+    *result = a > b;
+    return 1;
+  case CGT_I32_UN:
+    *result = value1 > value2;
+    return 1;
+  case CGE_I32:
+    *result = a >= b;
+    return 1;
+  case CGE_I32_UN:
+    *result = value1 >= value2;
+    return 1;
+  case CLT_I32:
+    *result = a < b;
+    return 1;
+  case CLT_I32_UN:
+    *result = value1 < value2;
+    return 1;
+  case CLE_I32:
+    *result = a <= b;
+    return 1;
+  case CLE_I32_UN:
+    *result = value1 <= value2;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static void _mango_optimize_decode(optimizer *o, uint8_t module) {
+  optimize_module *m = &o->modules[module];
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < m->size; i++) {
+    uint8_t flags = m->flags[i];
+    if ((flags & (OPT_START | OPT_FUNCTION)) == 0) {
+      continue;
+    }
+
+    const uint8_t *code = m->image + i;
+    optimize_insn *insn = &m->insns[count++];
+    *insn = (optimize_insn){0, OPT_NONE, (uint16_t)i, 0, code[0], 0, flags, 0};
+    insn->size = (uint8_t)(1 + opcode_infos[code[0]].args);
+
+    if (flags & OPT_FUNCTION) {
+      insn->size = offsetof(mango_func_def, code);
+    } else if (code[0] >= LDC_I32_M1 && code[0] <= LDC_I32_8) {
+      insn->value = (uint32_t)(code[0] - LDC_I32_0);
+    } else if (code[0] == LDC_I32_S) {
+      insn->value = (uint32_t)FETCH(code + 1, i8);
+    } else if (code[0] == LDC_X32) {
+      insn->value = FETCH(code + 1, u32);
+    } else if (code[0] >= BR_S && code[0] <= BRTRUE_S) {
+      insn->value = (uint32_t)((int32_t)i + 2 + FETCH(code + 1, i8));
+    } else if (code[0] >= BR && code[0] <= BRTRUE) {
+      insn->value = (uint32_t)((int32_t)i + 3 + FETCH(code + 1, i16));
+      insn->opcode = (uint8_t)(code[0] - (BR - BR_S));
+      insn->size = 2;
+    } else if (code[0] == CALL_S || code[0] == TAIL_CALL_S) {
+      insn->value = (uint32_t)module << 16 | FETCH(code + 1, u16);
+    } else if (code[0] == CALL || code[0] == TAIL_CALL || code[0] == LDFTN) {
+      int callee = _mango_optimize_callee(o, module, code[1]);
+      insn->value = (uint32_t)callee << 16 | FETCH(code + 2, u16);
+      if (code[0] != LDFTN && callee == module) {
+        insn->opcode = code[0] == CALL ? CALL_S : TAIL_CALL_S;
+        insn->size = 3;
+      }
+    }
+  }
+
+  m->count = count;
+}
+
+static void _mango_optimize_peephole(optimize_module *m) {
+  uint32_t last = OPT_NONE;
+
+  for (uint32_t i = 0; i < m->count; i++) {
+    optimize_insn *k = &m->insns[i];
+
+    if (k->flags & (OPT_FUNCTION | OPT_TARGET)) {
+      last = OPT_NONE;
+    }
+    if (k->flags & OPT_FUNCTION) {
+      continue;
+    }
+    if (_mango_optimize_is_constant(k)) {
+      _mango_optimize_constant(k, k->value);
+    }
+
+    k->previous = last;
+    optimize_insn *p = last != OPT_NONE ? &m->insns[last] : NULL;
+    optimize_insn *q =
+        p && p->previous != OPT_NONE ? &m->insns[p->previous] : NULL;
+    uint32_t value;
+
+    if (p && ((k->opcode == POP_X32 &&
+               (p->opcode == DUP_X32 || p->opcode == LDLOC_X32 ||
+                _mango_optimize_is_constant(p))) ||
+              (k->opcode == POP_X64 &&
+               (p->opcode == DUP_X64 || p->opcode == LDLOC_X64 ||
+                p->opcode == LDC_X64)))) {
+      p->size = 0;
+      k->size = 0;
+      last = p->previous;
+      continue;
+    }
+
+    if (p && _mango_optimize_is_constant(p) &&
+        (k->opcode == NEG_I32 || k->opcode == NOT_I32)) {
+      value = k->opcode == NEG_I32 ? 0 - p->value : ~p->value;
+      if (_mango_optimize_constant_size(value) <= p->size + k->size) {
+        _mango_optimize_constant(p, value);
+        k->size = 0;
+        continue;
+      }
+    }
+
+    if (q && _mango_optimize_is_constant(q) &&
+        _mango_optimize_is_constant(p) &&
+        _mango_optimize_fold(k->opcode, q->value, p->value, &value) &&
+        _mango_optimize_constant_size(value) <= q->size + p->size + k->size) {
+      _mango_optimize_constant(q, value);
+      p->size = 0;
+      k->size = 0;
+      last = p->previous;
+      continue;
+    }
+
+    switch (k->opcode) {
+    case HALT:
+    case RET:
+    case RET_X32:
+    case RET_X64:
+    case TAIL_CALLI:
+    case TAIL_CALL_S:
+    case TAIL_CALL:
+    case BR_S:
+      last = OPT_NONE;
+      break;
+    default:
+      last = i;
+      break;
+    }
+  }
+
+  // A branch to the next instruction that is kept does nothing but pop the
+  // condition.
+
+  for (uint32_t i = 0; i < m->count; i++) {
+    optimize_insn *k = &m->insns[i];
+    uint32_t j = i + 1;
+
+    if (!_mango_optimize_is_branch(k) || k->size == 0) {
+      continue;
+    }
+    while (j < m->count && m->insns[j].offset < k->value &&
+           m->insns[j].size == 0) {
+      j++;
+    }
+    if (j < m->count && m->insns[j].offset == k->value) {
+      k->opcode = k->opcode == BR_S ? NOP : POP_X32;
+      k->size = k->opcode == BR_S ? 0 : 1;
+    }
+  }
+}
+
+// Assigns addresses and returns whether a short branch had to be lengthened.
+// All branches start out short, and each is lengthened at most once.
+
+static int _mango_optimize_layout(optimize_module *m) {
+  uint32_t address = m->header;
+  int changed = 0;
+
+  for (uint32_t i = 0; i < m->count; i++) {
+    optimize_insn *insn = &m->insns[i];
+    if (insn->offset < m->header) {
+      insn->address = insn->offset;
+    } else {
+      insn->address = (uint16_t)address;
+      address += insn->size;
+    }
+    m->map[insn->offset] = insn->address;
+  }
+  m->optimized_size = address;
+
+  for (uint32_t i = 0; i < m->count; i++) {
+    optimize_insn *insn = &m->insns[i];
+    if (_mango_optimize_is_branch(insn) && insn->size == 2) {
+      int32_t offset = m->map[insn->value] - (insn->address + 2);
+      if (offset < INT8_MIN || offset > INT8_MAX) {
+        insn->opcode = (uint8_t)(insn->opcode + (BR - BR_S));
+        insn->size = 3;
+        changed = 1;
+      }
+    }
+  }
+
+  return changed;
+}
+
+static void _mango_optimize_put16(uint8_t *p, uint32_t value) {
+  p[0] = (uint8_t)value;
+  p[1] = (uint8_t)(value >> 8);
+}
+
+static void _mango_optimize_emit(const optimizer *o, uint8_t module,
+                                 uint8_t *output) {
+  const optimize_module *m = &o->modules[module];
+
+  size_t entry = offsetof(mango_module_def, entry_point) + 1; // CALL_S
+
+  memcpy(output, m->image, m->header);
+  _mango_optimize_put16(output + entry, m->map[FETCH(m->image + entry, u16)]);
+
+  for (uint32_t i = 0; i < m->count; i++) {
+    const optimize_insn *insn = &m->insns[i];
+    const uint8_t *code = m->image + insn->offset;
+    uint8_t *p = output + insn->address;
+
+    if (insn->size == 0 || insn->offset < m->header) {
+      continue;
+    }
+    if (insn->flags & OPT_FUNCTION) {
+      memcpy(p, code, insn->size);
+      continue;
+    }
+
+    p[0] = insn->opcode;
+
+    switch (insn->opcode) {
+    case LDC_I32_S:
+      p[1] = (uint8_t)insn->value;
+      break;
+    case LDC_X32:
+      for (uint_fast8_t j = 0; j < 4; j++) {
+        p[1 + j] = (uint8_t)(insn->value >> (8 * j));
+      }
+      break;
+    case BR_S:
+    case BRFALSE_S:
+    case BRTRUE_S:
+      p[1] = (uint8_t)(m->map[insn->value] - (insn->address + 2));
+      break;
+    case BR:
+    case BRFALSE:
+    case BRTRUE:
+      _mango_optimize_put16(
+          p + 1, (uint32_t)(m->map[insn->value] - (insn->address + 3)));
+      break;
+    case CALL_S:
+    case TAIL_CALL_S:
+      _mango_optimize_put16(
+          p + 1, o->modules[insn->value >> 16].map[insn->value & 0xFFFF]);
+      break;
+    case CALL:
+    case TAIL_CALL:
+    case LDFTN:
+      p[1] = code[1];
+      _mango_optimize_put16(
+          p + 2, o->modules[insn->value >> 16].map[insn->value & 0xFFFF]);
+      break;
+    default:
+      if (insn->opcode == code[0]) {
+        memcpy(p, code, insn->size);
+      }
+      break;
+    }
+  }
+}
+
+#endif
+
+size_t mango_optimize_size(const mango_module_image *images, size_t count) {
+#if defined(MANGO_OPTIMIZER)
+  if (!images || count == 0 || count > UINT8_MAX) {
+    return 0;
+  }
+
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!images[i].image || images[i].size > UINT16_MAX) {
+      return 0;
+    }
+    total += images[i].size;
+  }
+
+  return total + count * sizeof(optimize_module) +
+         total * (sizeof(optimize_insn) + sizeof(optimize_item) +
+                  sizeof(uint16_t) + sizeof(uint8_t)) +
+         4 * sizeof(uint64_t);
+#else
+  (void)images;
+  (void)count;
+  return 0;
+#endif
+}
+
+// Writes the optimized images to the start of `address` and describes them
+// in `optimized`, in the same order as `images`; the rest of `address` is
+// scratch space. Every module the program imports must be in `images`.
+
+mango_result mango_optimize(const mango_module_image *images, size_t count,
+                            void *address, size_t size,
+                            mango_module_image *optimized) {
+  if (!images || !address || !optimized) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+
+#if defined(MANGO_OPTIMIZER)
+  size_t required = mango_optimize_size(images, count);
+  if (required == 0) {
+    return MANGO_E_ARGUMENT;
+  }
+  if (size < required) {
+    return MANGO_E_OUT_OF_MEMORY;
+  }
+
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    total += images[i].size;
+  }
+
+  uintptr_t cursor = (uintptr_t)address;
+  uint8_t *output = _mango_optimize_carve(&cursor, total, 1, 1);
+  optimizer o = {
+      images,
+      _mango_optimize_carve(&cursor, count, sizeof(optimize_module),
+                            __alignof(optimize_module)),
+      _mango_optimize_carve(&cursor, total, sizeof(optimize_item),
+                            __alignof(optimize_item)),
+      0,
+      (uint32_t)count,
+  };
+  optimize_insn *insns = _mango_optimize_carve(
+      &cursor, total, sizeof(optimize_insn), __alignof(optimize_insn));
+  uint16_t *map = _mango_optimize_carve(&cursor, total, sizeof(uint16_t),
+                                        __alignof(uint16_t));
+  uint8_t *flags = _mango_optimize_carve(&cursor, total, 1, 1);
+
+  for (size_t i = 0; i < count; i++) {
+    const mango_module_def *m = (const mango_module_def *)images[i].image;
+    size_t header = sizeof(mango_module_def) +
+                    (images[i].size < sizeof(mango_module_def)
+                         ? 0
+                         : m->import_count * sizeof(mango_fingerprint));
+
+    if (images[i].size < header || m->version != MANGO_VERSION_MAJOR ||
+        m->entry_point[0] != CALL_S || m->entry_point[3] != HALT ||
+        m->module_count == 0 || m->import_count > m->module_count) {
+      return MANGO_E_BAD_IMAGE_FORMAT;
+    }
+    if ((m->features & mango_features()) != m->features) {
+      return MANGO_E_NOT_SUPPORTED;
+    }
+
+    o.modules[i] = (optimize_module){
+        images[i].image, flags, map, insns, (uint32_t)images[i].size,
+        (uint32_t)header, 0, 0};
+    memset(flags, OPT_OPERAND, header);
+    memset(flags + header, 0, images[i].size - header);
+    memset(flags + offsetof(mango_module_def, entry_point), 0,
+           sizeof(m->entry_point));
+    flags += images[i].size;
+    map += images[i].size;
+    insns += images[i].size;
+
+    _mango_optimize_visit(&o, (uint8_t)i,
+                          offsetof(mango_module_def, entry_point));
+  }
+
+  while (o.item_count != 0) {
+    mango_result result = _mango_optimize_step(&o, o.items[--o.item_count]);
+    if (result != MANGO_E_SUCCESS) {
+      return result;
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    _mango_optimize_decode(&o, (uint8_t)i);
+    _mango_optimize_peephole(&o.modules[i]);
+  }
+
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (size_t i = 0; i < count; i++) {
+      changed |= _mango_optimize_layout(&o.modules[i]);
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    _mango_optimize_emit(&o, (uint8_t)i, output);
+    optimized[i] = (mango_module_image){images[i].fingerprint, output,
+                                       o.modules[i].optimized_size,
+                                       images[i].context};
+    output += images[i].size;
+  }
+
+  return MANGO_E_SUCCESS;
+#else
+  (void)count;
+  (void)size;
+  return MANGO_E_NOT_SUPPORTED;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
 
 #define VISITED 1
 
+#define SYSCALL_DEFERRED 113
+
 static mango_result _mango_interpret(mango_vm *vm);
 
-mango_result mango_run(mango_vm *vm) {
-  if (!vm) {
+static mango_result _mango_run(mango_vm *vm) {
+  if (vm->modules_imported == 0 ||
+      vm->modules_imported != vm->modules_created) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+  if (vm->result > MANGO_E_SUCCESS && vm->result < MANGO_E_BREAKPOINT) {
+    return vm->result;
+  }
+  if (vm->result == SYSCALL_DEFERRED) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+  if (vm->sp != vm->sp_expected) {
+    return vm->result = MANGO_E_STACK_IMBALANCE;
+  }
+
+  mango_result result = _mango_interpret(vm);
+  if (result != MANGO_E_SUCCESS) {
+    return vm->result = (uint8_t)result;
+  }
+
+  mango_module *modules = _mango_get_modules(vm);
+  uint8_t head = vm->init_head;
+
+  while (head != INVALID_MODULE) {
+    mango_module *module = &modules[head];
+
+    if ((module->init_flags & VISITED) == 0) {
+      module->init_flags |= VISITED;
+
+      const uint8_t *imports = _mango_get_module_imports(vm, module);
+
+      for (uint_fast8_t i = 0; i < module->import_count; i++) {
+        uint8_t p = imports[i];
+        mango_module *import = &modules[p];
+
+        if ((import->init_flags & VISITED) == 0) {
+          if (head != p) {
+            if (import->init_prev != INVALID_MODULE) {
+              modules[import->init_prev].init_next = import->init_next;
+            }
+            if (import->init_next != INVALID_MODULE) {
+              modules[import->init_next].init_prev = import->init_prev;
+            }
+            if (head != INVALID_MODULE) {
+              modules[head].init_prev = p;
+            }
+            import->init_next = head;
+            import->init_prev = INVALID_MODULE;
+            head = p;
+          }
+        }
+      }
+    } else {
+      vm->sf = (stack_frame){0, head,
+                             (uint16_t)offsetof(mango_module_def, entry_point)};
+
+      head = module->init_next;
+      vm->init_head = head;
+      module->init_next = INVALID_MODULE;
+      module->init_prev = INVALID_MODULE;
+      if (head != INVALID_MODULE) {
+        modules[head].init_prev = INVALID_MODULE;
+      }
+
+      result = _mango_interpret(vm);
+      if (result != MANGO_E_SUCCESS) {
+        return vm->result = (uint8_t)result;
+      }
+    }
+  }
+
+  return MANGO_E_SUCCESS;
+}
+
+mango_result mango_run(mango_vm *vm) {
+  if (!vm) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+
+  vm->fuel = UINT32_MAX;
+  vm->metered = 0;
+  return _mango_run(vm);
+}
+
+mango_result mango_run_with_budget(mango_vm *vm, uint32_t fuel) {
+  if (!vm) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+
+  vm->fuel = fuel;
+  vm->metered = 1;
+  return _mango_run(vm);
+}
+
+int mango_syscall(const mango_vm *vm) { return vm ? vm->syscall : 0; }
+
+// Syscalls with a function in the registered table are called directly from
+// the interpreter instead of yielding to the host. A function gets the
+// arguments at the top of the stack and puts the results at the top of the
+// stack after the syscall's adjustment; both may overlap. It returns
+// MANGO_E_SUCCESS to continue, an error to stop the VM, or MANGO_E_SYSTEM_CALL
+// to yield as if it were not registered. Any other result stops the VM with
+// MANGO_E_INVALID_OPERATION. The table must outlive the VM.
+
+static inline mango_syscall_func _mango_get_syscall_func(const mango_vm *vm,
+                                                         uint16_t syscall) {
+  const syscall_table *t =
+      (const syscall_table *)_mango_get_reserved(vm, SYSCALL_TABLE_OFFSET);
+  const mango_syscall_func *functions;
+
+  if (syscall >= t->count) {
+    return NULL;
+  }
+
+  memcpy(&functions, t->functions, sizeof(functions));
+  return functions[syscall];
+}
+
+mango_result mango_syscall_register(mango_vm *vm,
+                                    const mango_syscall_func *functions,
+                                    size_t count) {
+  if (!vm || (!functions && count != 0)) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+  if (count > UINT16_MAX + 1) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  syscall_table *t = (syscall_table *)_mango_get_reserved(vm,
+                                                          SYSCALL_TABLE_OFFSET);
+  memcpy(t->functions, &functions, sizeof(functions));
+  t->count = (uint32_t)count;
+  return MANGO_E_SUCCESS;
+}
+
+// A syscall that cannot be completed right away can be deferred. The VM then
+// refuses to run until the host completes the syscall with the token it got
+// from mango_syscall_defer, so a single thread can keep many VMs waiting on
+// I/O and resume each one when its completion arrives. Tokens are never zero
+// and are not reused until 2^32 - 1 more syscalls of the same VM have been
+// deferred, so late or duplicate completions are rejected.
+
+static inline uint32_t *_mango_get_syscall_token(const mango_vm *vm) {
+  return (uint32_t *)_mango_get_reserved(vm, SYSCALL_TOKEN_OFFSET);
+}
+
+uint32_t mango_syscall_defer(mango_vm *vm) {
+  if (!vm || vm->result != MANGO_E_SYSTEM_CALL) {
+    return 0;
+  }
+
+  uint32_t *token = _mango_get_syscall_token(vm);
+  *token = *token == UINT32_MAX ? 1 : *token + 1;
+  vm->result = SYSCALL_DEFERRED;
+  return *token;
+}
+
+// The results go where the syscall's adjustment leaves the top of the stack.
+// Sites the verifier did not reach are only bounded by the stack itself.
+
+static size_t _mango_syscall_results(const mango_vm *vm) {
+  const syscall_sites *t = _mango_get_syscall_sites(vm);
+  const syscall_site *sites = (const syscall_site *)void_as_ptr(vm, t->sites);
+  uint16_t ip = (uint16_t)(vm->sf.ip - 4);
+  size_t limit = (size_t)vm->stack_size - vm->sp_expected;
+  uint32_t low = 0;
+  uint32_t high = t->count;
+
+  while (low < high) {
+    uint32_t mid = low + (high - low) / 2;
+    if (sites[mid].module < vm->sf.module ||
+        (sites[mid].module == vm->sf.module && sites[mid].ip < ip)) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  if (low < t->count && sites[low].module == vm->sf.module &&
+      sites[low].ip == ip && sites[low].cells < limit) {
+    limit = sites[low].cells;
+  }
+  return limit * sizeof(stackval);
+}
+
+mango_result mango_syscall_complete(mango_vm *vm, uint32_t token,
+                                    const void *results, size_t size) {
+  if (!vm || (!results && size != 0)) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+  if (vm->result != SYSCALL_DEFERRED ||
+      token != *_mango_get_syscall_token(vm)) {
+    return MANGO_E_INVALID_OPERATION;
+  }
+  if (vm->sp_expected < vm->rp) {
+    return MANGO_E_STACK_OVERFLOW;
+  }
+  if (size > _mango_syscall_results(vm)) {
+    return MANGO_E_ARGUMENT;
+  }
+
+  vm->sp = vm->sp_expected;
+  if (size != 0) {
+    memcpy(&vm->stack[vm->sp], results, size);
+  }
+  vm->result = MANGO_E_SYSTEM_CALL;
+  return MANGO_E_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The scheduler runs VMs on a fixed set of worker threads. Each worker owns a
+// Chase-Lev deque: it pushes VMs at the bottom and, like every other worker,
+// takes them from the top, so the VMs of one worker are run round-robin and
+// idle workers steal the oldest ones. VMs submitted by the host go through a
+// separate queue guarded by a mutex. Workers with nothing to do sleep on a
+// condition variable until a VM becomes runnable.
+
+#if defined(MANGO_SCHEDULER)
+
+typedef struct scheduler_worker {
+  _Alignas(64) _Atomic(int64_t) top;
+  _Alignas(64) _Atomic(int64_t) bottom;
+  _Atomic(mango_vm *) *items;
+  mango_scheduler *scheduler;
+  pthread_t thread;
+} scheduler_worker;
+
+struct mango_scheduler {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  mango_schedule_func callback;
+  void *state;
+  uint32_t fuel;
+  uint32_t capacity;
+  uint32_t worker_count;
+  uint32_t workers_started;
+  uint32_t submit_head;
+  uint32_t submit_tail;
+  mango_vm **submitted;
+  _Atomic(uint32_t) count;
+  _Atomic(uint32_t) runnable;
+  _Atomic(uint32_t) sleeping;
+  _Atomic(int) stopping;
+  scheduler_worker workers[];
+};
+
+static size_t _mango_scheduler_layout(size_t workers, size_t capacity) {
+  return sizeof(mango_scheduler) + workers * sizeof(scheduler_worker) +
+         (workers + 1) * capacity * sizeof(mango_vm *);
+}
+
+// Only the owner pushes, and the deque can hold every VM of the scheduler.
+static void _mango_deque_push(scheduler_worker *w, mango_vm *vm) {
+  int64_t b = atomic_load_explicit(&w->bottom, memory_order_relaxed);
+  uint32_t mask = w->scheduler->capacity - 1;
+  atomic_store_explicit(&w->items[(uint64_t)b & mask], vm,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+}
+
+static mango_vm *_mango_deque_steal(scheduler_worker *w) {
+  int64_t t = atomic_load_explicit(&w->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t b = atomic_load_explicit(&w->bottom, memory_order_acquire);
+  uint32_t mask = w->scheduler->capacity - 1;
+
+  while (t < b) {
+    mango_vm *vm = atomic_load_explicit(&w->items[(uint64_t)t & mask],
+                                        memory_order_relaxed);
+    if (atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1,
+                                                memory_order_seq_cst,
+                                                memory_order_relaxed)) {
+      return vm;
+    }
+    b = atomic_load_explicit(&w->bottom, memory_order_acquire);
+  }
+  return NULL;
+}
+
+static mango_vm *_mango_scheduler_next(scheduler_worker *w) {
+  mango_scheduler *s = w->scheduler;
+  uint32_t self = (uint32_t)(w - s->workers);
+  mango_vm *vm = _mango_deque_steal(w);
+
+  for (uint32_t i = 1; !vm && i < s->worker_count; i++) {
+    vm = _mango_deque_steal(&s->workers[(self + i) % s->worker_count]);
+  }
+  if (!vm) {
+    pthread_mutex_lock(&s->lock);
+    if (s->submit_head != s->submit_tail) {
+      vm = s->submitted[s->submit_head++ & (s->capacity - 1)];
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+  if (vm) {
+    atomic_fetch_sub(&s->runnable, 1);
+  }
+  return vm;
+}
+
+// Runnable is raised before a VM is published, so it never drops below zero.
+static void _mango_scheduler_notify(mango_scheduler *s) {
+  if (atomic_load(&s->sleeping) != 0) {
+    pthread_mutex_lock(&s->lock);
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+static void *_mango_scheduler_work(void *arg) {
+  scheduler_worker *w = (scheduler_worker *)arg;
+  mango_scheduler *s = w->scheduler;
+
+  while (!atomic_load(&s->stopping)) {
+    mango_vm *vm = _mango_scheduler_next(w);
+
+    if (!vm) {
+      pthread_mutex_lock(&s->lock);
+      atomic_fetch_add(&s->sleeping, 1);
+      while (!atomic_load(&s->stopping) && atomic_load(&s->runnable) == 0) {
+        pthread_cond_wait(&s->wake, &s->lock);
+      }
+      atomic_fetch_sub(&s->sleeping, 1);
+      pthread_mutex_unlock(&s->lock);
+      continue;
+    }
+
+    mango_result result =
+        s->fuel ? mango_run_with_budget(vm, s->fuel) : mango_run(vm);
+
+    if (result == MANGO_E_TIMEOUT || s->callback(s->state, vm, result)) {
+      atomic_fetch_add(&s->runnable, 1);
+      _mango_deque_push(w, vm);
+      _mango_scheduler_notify(s);
+    } else {
+      atomic_fetch_sub(&s->count, 1);
+    }
+  }
+  return NULL;
+}
+
+#endif
+
+size_t mango_scheduler_size(int workers, size_t capacity) {
+#if defined(MANGO_SCHEDULER)
+  if (workers < 1 || workers > UINT8_MAX || capacity == 0 ||
+      capacity > UINT16_MAX + 1 || (capacity & (capacity - 1)) != 0) {
+    return 0;
+  }
+  return _mango_scheduler_layout((size_t)workers, capacity);
+#else
+  (void)workers;
+  (void)capacity;
+  return 0;
+#endif
+}
+
+// Starts `workers` threads that run up to `capacity` VMs, a power of two, in
+// slices of `fuel` (or to the next yield if zero). Whenever a VM yields for
+// anything but a timeout, `callback` is called on the worker thread; the VM
+// is run again if it returns non-zero and is handed back to the host
+// otherwise. A deferred syscall is handed back and resubmitted by the host
+// after it has been completed.
+
+mango_scheduler *mango_scheduler_create(void *address, size_t size,
+                                        int workers, size_t capacity,
+                                        uint32_t fuel,
+                                        mango_schedule_func callback,
+                                        void *state) {
+#if defined(MANGO_SCHEDULER)
+  if (!address || !callback ||
+      ((uintptr_t)address & (__alignof(mango_scheduler) - 1)) != 0) {
+    return NULL;
+  }
+
+  size_t required = mango_scheduler_size(workers, capacity);
+  if (required == 0 || size < required) {
+    return NULL;
+  }
+
+  mango_scheduler *s = (mango_scheduler *)address;
+  memset(s, 0, required);
+  s->callback = callback;
+  s->state = state;
+  s->fuel = fuel;
+  s->capacity = (uint32_t)capacity;
+  s->worker_count = (uint32_t)workers;
+
+  _Atomic(mango_vm *) *items =
+      (_Atomic(mango_vm *) *)&s->workers[s->worker_count];
+  for (uint32_t i = 0; i < s->worker_count; i++) {
+    s->workers[i].items = items + i * capacity;
+    s->workers[i].scheduler = s;
+  }
+  s->submitted = (mango_vm **)(items + s->worker_count * capacity);
+
+  if (pthread_mutex_init(&s->lock, NULL) != 0) {
+    return NULL;
+  }
+  if (pthread_cond_init(&s->wake, NULL) != 0) {
+    pthread_mutex_destroy(&s->lock);
+    return NULL;
+  }
+  while (s->workers_started < s->worker_count) {
+    scheduler_worker *w = &s->workers[s->workers_started];
+    if (pthread_create(&w->thread, NULL, _mango_scheduler_work, w) != 0) {
+      mango_scheduler_shutdown(s);
+      return NULL;
+    }
+    s->workers_started++;
+  }
+  return s;
+#else
+  (void)address;
+  (void)size;
+  (void)workers;
+  (void)capacity;
+  (void)fuel;
+  (void)callback;
+  (void)state;
+  return NULL;
+#endif
+}
+
+mango_result mango_scheduler_submit(mango_scheduler *scheduler, mango_vm *vm) {
+#if defined(MANGO_SCHEDULER)
+  if (!scheduler || !vm) {
     return MANGO_E_ARGUMENT_NULL;
   }
-  if (vm->modules_imported == 0 ||
-      vm->modules_imported != vm->modules_created) {
-    return MANGO_E_INVALID_OPERATION;
+
+  mango_scheduler *s = scheduler;
+  uint32_t count = atomic_load(&s->count);
+  do {
+    if (count == s->capacity) {
+      return MANGO_E_OUT_OF_MEMORY;
+    }
+  } while (!atomic_compare_exchange_weak(&s->count, &count, count + 1));
+
+  atomic_fetch_add(&s->runnable, 1);
+  pthread_mutex_lock(&s->lock);
+  s->submitted[s->submit_tail++ & (s->capacity - 1)] = vm;
+  pthread_mutex_unlock(&s->lock);
+  _mango_scheduler_notify(s);
+  return MANGO_E_SUCCESS;
+#else
+  (void)scheduler;
+  (void)vm;
+  return MANGO_E_NOT_SUPPORTED;
+#endif
+}
+
+// Stops and joins all workers once they have finished their current slice.
+// VMs still queued are simply dropped; they belong to the host as before.
+
+void mango_scheduler_shutdown(mango_scheduler *scheduler) {
+#if defined(MANGO_SCHEDULER)
+  if (!scheduler) {
+    return;
   }
-  if (vm->result > MANGO_E_SUCCESS && vm->result < MANGO_E_BREAKPOINT) {
-    return vm->result;
+
+  mango_scheduler *s = scheduler;
+  pthread_mutex_lock(&s->lock);
+  atomic_store(&s->stopping, 1);
+  pthread_cond_broadcast(&s->wake);
+  pthread_mutex_unlock(&s->lock);
+
+  for (uint32_t i = 0; i < s->workers_started; i++) {
+    pthread_join(s->workers[i].thread, NULL);
   }
-  if (vm->sp != vm->sp_expected) {
-    return vm->result = MANGO_E_STACK_IMBALANCE;
+  pthread_cond_destroy(&s->wake);
+  pthread_mutex_destroy(&s->lock);
+#else
+  (void)scheduler;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Profiling builds count every instruction the interpreter dispatches into a
+// buffer supplied by the host: one counter per opcode, one per pair of
+// consecutive opcodes, and a calling-context tree that records the calls and
+// the instructions executed for each distinct path of calls. The tree has a
+// fixed number of nodes; calls beyond that are not recorded, and the
+// instructions they execute are counted towards the deepest recorded caller.
+// A tail call replaces the node of its caller, just like it replaces the
+// caller's frame.
+
+#if defined(MANGO_PROFILE)
+
+typedef struct profile_node {
+  uint64_t calls;
+  uint64_t instructions;
+  uint32_t parent;
+  uint32_t child;
+  uint32_t sibling;
+  uint16_t offset;
+  uint8_t module;
+  uint8_t _reserved;
+} profile_node;
+
+typedef struct profile_buffer {
+  uint64_t opcodes[256];
+  uint64_t pairs[256][256];
+  uint32_t node;
+  uint32_t node_count;
+  uint32_t node_capacity;
+  uint32_t lost;
+  uint32_t previous;
+  uint32_t _reserved;
+  profile_node nodes[];
+} profile_buffer;
+
+#define PROFILE_NO_OPCODE 256
+
+static const char *const opcode_names[256] = {
+#define OPCODE(c, s, pop, push, args, i) s,
+#include "mango_opcodes.inc"
+#undef OPCODE
+};
+
+static inline profile_buffer *_mango_get_profile(const mango_vm *vm) {
+  profile_buffer *profile;
+  memcpy(&profile, _mango_get_reserved(vm, PROFILE_POINTER_OFFSET),
+         sizeof(profile));
+  return profile;
+}
+
+static inline void _mango_profile_step(profile_buffer *profile,
+                                       uint8_t opcode) {
+  profile->opcodes[opcode]++;
+  if (profile->previous != PROFILE_NO_OPCODE) {
+    profile->pairs[profile->previous][opcode]++;
   }
+  profile->previous = opcode;
+  profile->nodes[profile->node].instructions++;
+}
 
-  mango_result result = _mango_interpret(vm);
-  if (result != MANGO_E_SUCCESS) {
-    return vm->result = (uint8_t)result;
+static void _mango_profile_call(profile_buffer *profile, uint8_t module,
+                                uint16_t offset, int tail) {
+  if (profile->lost != 0) {
+    profile->lost += tail ? 0 : 1;
+    return;
   }
 
-  mango_module *modules = _mango_get_modules(vm);
-  uint8_t head = vm->init_head;
+  profile_node *nodes = profile->nodes;
+  uint32_t parent = tail ? nodes[profile->node].parent : profile->node;
+  uint32_t node = nodes[parent].child;
 
-  while (head != INVALID_MODULE) {
-    mango_module *module = &modules[head];
+  while (node != 0 &&
+         (nodes[node].module != module || nodes[node].offset != offset)) {
+    node = nodes[node].sibling;
+  }
 
-    if ((module->init_flags & VISITED) == 0) {
-      module->init_flags |= VISITED;
+  if (node == 0) {
+    if (profile->node_count == profile->node_capacity) {
+      profile->lost += tail ? 0 : 1;
+      return;
+    }
+    node = profile->node_count++;
+    nodes[node] = (profile_node){0, 0, parent, 0, nodes[parent].child,
+                                 offset, module, 0};
+    nodes[parent].child = node;
+  }
 
-      const uint8_t *imports = _mango_get_module_imports(vm, module);
+  nodes[node].calls++;
+  profile->node = node;
+}
 
-      for (uint_fast8_t i = 0; i < module->import_count; i++) {
-        uint8_t p = imports[i];
-        mango_module *import = &modules[p];
+static inline void _mango_profile_return(profile_buffer *profile) {
+  if (profile->lost != 0) {
+    profile->lost--;
+  } else {
+    profile->node = profile->nodes[profile->node].parent;
+  }
+}
 
-        if ((import->init_flags & VISITED) == 0) {
-          if (head != p) {
-            if (import->init_prev != INVALID_MODULE) {
-              modules[import->init_prev].init_next = import->init_next;
-            }
-            if (import->init_next != INVALID_MODULE) {
-              modules[import->init_next].init_prev = import->init_prev;
-            }
-            if (head != INVALID_MODULE) {
-              modules[head].init_prev = p;
-            }
-            import->init_next = head;
-            import->init_prev = INVALID_MODULE;
-            head = p;
-          }
-        }
-      }
-    } else {
-      vm->sf = (stack_frame){0, head,
-                             (uint16_t)offsetof(mango_module_def, entry_point)};
+typedef struct profile_writer {
+  char *buffer;
+  size_t size;
+  size_t length;
+} profile_writer;
 
-      head = module->init_next;
-      vm->init_head = head;
-      module->init_next = INVALID_MODULE;
-      module->init_prev = INVALID_MODULE;
-      if (head != INVALID_MODULE) {
-        modules[head].init_prev = INVALID_MODULE;
+static void _mango_profile_write(profile_writer *w, size_t at,
+                                 const char *text, size_t count) {
+  for (size_t i = 0; i < count && at + i + 1 < w->size; i++) {
+    w->buffer[at + i] = text[i];
+  }
+}
+
+static void _mango_profile_append(profile_writer *w, const char *text,
+                                  size_t count) {
+  _mango_profile_write(w, w->length, text, count);
+  w->length += count;
+}
+
+static size_t _mango_profile_format(char *text, uint64_t value, unsigned base,
+                                    size_t digits) {
+  char reversed[20];
+  size_t count = 0;
+  do {
+    reversed[count++] = "0123456789abcdef"[value % base];
+    value /= base;
+  } while (value != 0 || count < digits);
+  for (size_t i = 0; i < count; i++) {
+    text[i] = reversed[count - 1 - i];
+  }
+  return count;
+}
+
+static void _mango_profile_count(profile_writer *w, uint64_t count) {
+  char text[24] = {' '};
+  size_t length = 1 + _mango_profile_format(text + 1, count, 10, 1);
+  text[length++] = '\n';
+  _mango_profile_append(w, text, length);
+}
+
+// Functions are named after the module index and the offset of their
+// definition in the module image, e.g. "m1:002a".
+
+static size_t _mango_profile_frame(const profile_buffer *profile,
+                                   uint32_t node, char *text) {
+  if (node == 0) {
+    memcpy(text, "entry", 5);
+    return 5;
+  }
+  size_t length = 0;
+  text[length++] = 'm';
+  length += _mango_profile_format(text + length,
+                                  profile->nodes[node].module, 10, 1);
+  text[length++] = ':';
+  length += _mango_profile_format(text + length,
+                                  profile->nodes[node].offset, 16, 4);
+  return length;
+}
+
+// Writes the path from the root to a node in the folded format understood by
+// flame graph tools. The path is built from the node upwards, so the line is
+// measured first and then filled in from its end.
+
+static void _mango_profile_stack(profile_writer *w,
+                                 const profile_buffer *profile, uint32_t node,
+                                 uint64_t count) {
+  char text[16];
+  size_t length = 0;
+  for (uint32_t i = node;; i = profile->nodes[i].parent) {
+    length += _mango_profile_frame(profile, i, text);
+    if (i == 0) {
+      break;
+    }
+    length++;
+  }
+
+  size_t at = w->length + length;
+  for (uint32_t i = node;; i = profile->nodes[i].parent) {
+    size_t n = _mango_profile_frame(profile, i, text);
+    at -= n;
+    _mango_profile_write(w, at, text, n);
+    if (i == 0) {
+      break;
+    }
+    _mango_profile_write(w, --at, ";", 1);
+  }
+
+  w->length += length;
+  _mango_profile_count(w, count);
+}
+
+static void _mango_profile_opcode(profile_writer *w, uint_fast16_t opcode) {
+  const char *name = opcode_names[opcode];
+  _mango_profile_append(w, name, strlen(name));
+}
+
+#endif
+
+size_t mango_profile_size(size_t nodes) {
+#if defined(MANGO_PROFILE)
+  if (nodes == 0 || nodes > UINT32_MAX ||
+      nodes > (SIZE_MAX - sizeof(profile_buffer)) / sizeof(profile_node)) {
+    return 0;
+  }
+  return sizeof(profile_buffer) + nodes * sizeof(profile_node);
+#else
+  (void)nodes;
+  return 0;
+#endif
+}
+
+// Attaching a buffer clears it; the call tree starts at the current frame of
+// the VM, so the host normally attaches before running the VM for the first
+// time. Passing NULL detaches the buffer, which the host can then dump
+// directly or attach again later to start over.
+
+mango_result mango_profile_attach(mango_vm *vm, void *buffer, size_t size) {
+  if (!vm) {
+    return MANGO_E_ARGUMENT_NULL;
+  }
+
+#if defined(MANGO_PROFILE)
+  profile_buffer *profile = buffer;
+  if (profile) {
+    if (((uintptr_t)profile & (__alignof(profile_buffer) - 1)) != 0) {
+      return MANGO_E_ARGUMENT;
+    }
+    if (size < sizeof(profile_buffer) + sizeof(profile_node)) {
+      return MANGO_E_ARGUMENT;
+    }
+
+    size_t capacity = (size - sizeof(profile_buffer)) / sizeof(profile_node);
+    memset(profile, 0, sizeof(profile_buffer) + sizeof(profile_node));
+    profile->node_count = 1;
+    profile->node_capacity =
+        capacity > UINT32_MAX ? UINT32_MAX : (uint32_t)capacity;
+    profile->previous = PROFILE_NO_OPCODE;
+  }
+
+  memcpy(_mango_get_reserved(vm, PROFILE_POINTER_OFFSET), &profile,
+         sizeof(profile));
+  return MANGO_E_SUCCESS;
+#else
+  (void)buffer;
+  (void)size;
+  return MANGO_E_NOT_SUPPORTED;
+#endif
+}
+
+// Writes the profile as text, one "frames count" line per entry, and returns
+// the length of the full text like snprintf. Stacks are weighted by the
+// instructions executed in the innermost function and calls by the number of
+// times the innermost function was called on that path; opcode pairs are
+// written as two frames, so all kinds can be fed to flame graph tools.
+
+size_t mango_profile_dump(const mango_vm *vm, int kind, char *buffer,
+                          size_t size) {
+#if defined(MANGO_PROFILE)
+  const profile_buffer *profile = vm ? _mango_get_profile(vm) : NULL;
+  if (!profile || (!buffer && size != 0)) {
+    return 0;
+  }
+
+  profile_writer w = {buffer, size, 0};
+
+  switch (kind) {
+  case MANGO_PROFILE_STACKS:
+  case MANGO_PROFILE_CALLS:
+    for (uint32_t i = 0; i < profile->node_count; i++) {
+      uint64_t count = kind == MANGO_PROFILE_STACKS
+                           ? profile->nodes[i].instructions
+                           : profile->nodes[i].calls;
+      if (count != 0) {
+        _mango_profile_stack(&w, profile, i, count);
       }
+    }
+    break;
 
-      result = _mango_interpret(vm);
-      if (result != MANGO_E_SUCCESS) {
-        return vm->result = (uint8_t)result;
+  case MANGO_PROFILE_OPCODES:
+    for (uint_fast16_t i = 0; i < 256; i++) {
+      if (profile->opcodes[i] != 0) {
+        _mango_profile_opcode(&w, i);
+        _mango_profile_count(&w, profile->opcodes[i]);
       }
     }
+    break;
+
+  case MANGO_PROFILE_PAIRS:
+    for (uint_fast16_t i = 0; i < 256; i++) {
+      for (uint_fast16_t j = 0; j < 256; j++) {
+        if (profile->pairs[i][j] != 0) {
+          _mango_profile_opcode(&w, i);
+          _mango_profile_append(&w, ";", 1);
+          _mango_profile_opcode(&w, j);
+          _mango_profile_count(&w, profile->pairs[i][j]);
+        }
+      }
+    }
+    break;
+
+  default:
+    return 0;
   }
 
-  return MANGO_E_SUCCESS;
+  if (size != 0) {
+    buffer[w.length < size ? w.length : size - 1] = '\0';
+  }
+  return w.length;
+#else
+  (void)vm;
+  (void)kind;
+  (void)buffer;
+  (void)size;
+  return 0;
+#endif
 }
 
-int mango_syscall(const mango_vm *vm) { return vm ? vm->syscall : 0; }
+////////////////////////////////////////////////////////////////////////////////
+
+// While a VM is not running, its current frame and return stack describe
+// where it stopped. Sampling builds also keep them up to date while the
+// interpreter runs: at every call, return and backward branch, so that a
+// signal handler that interrupts the interpreter on the same thread can
+// unwind the VM. The module of the current frame is invalidated before the
+// frame changes and restored afterwards; a handler that interrupts an update
+// finds no frames and drops the sample. Native code of the JIT does not
+// update the position within a function, only calls and returns do.
+
+#if defined(MANGO_SAMPLING)
+
+static inline void _mango_publish_frame(mango_vm *vm, stack_frame sf,
+                                        uint16_t ip, const stackval *rp) {
+  volatile stack_frame *published = &vm->sf;
+  volatile uint16_t *published_rp = &vm->rp;
+
+  atomic_signal_fence(memory_order_release);
+  published->module = INVALID_MODULE;
+  published->pop = sf.pop;
+  published->ip = ip;
+  *published_rp = (uint16_t)(rp - vm->stack);
+  published->module = sf.module;
+}
+
+static inline void _mango_publish_ip(mango_vm *vm, uint16_t ip) {
+  volatile stack_frame *published = &vm->sf;
+  published->ip = ip;
+}
+
+#endif
+
+// Writes up to `count` frames, innermost first, and returns the number of
+// frames written. The offsets are relative to the module image: the current
+// position of the innermost frame and the return address of each caller.
+// Only reads the VM, so it can be called from a signal handler.
+
+size_t mango_unwind(const mango_vm *vm, mango_frame *frames, size_t count) {
+  if (!vm || (!frames && count != 0)) {
+    return 0;
+  }
+
+  const volatile stack_frame *published = &vm->sf;
+  const volatile uint16_t *published_rp = &vm->rp;
+
+  uint8_t module = published->module;
+  uint16_t ip = published->ip;
+  uint16_t rp = *published_rp;
+  if (module >= vm->modules_imported || rp > vm->stack_size) {
+    return 0;
+  }
+#if defined(MANGO_SAMPLING)
+  atomic_signal_fence(memory_order_acquire);
+#endif
+
+  size_t n = 0;
+  if (n < count) {
+    frames[n++] = (mango_frame){module, ip};
+  }
+  while (rp != 0 && n < count) {
+    const volatile stack_frame *f = &vm->stack[--rp].sf;
+    frames[n++] = (mango_frame){f->module, f->ip};
+  }
+  return n;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -653,10 +4681,45 @@ int mango_syscall(const mango_vm *vm) { return vm ? vm->syscall : 0; }
 
 #pragma region macros
 
-#if !defined(__EDG__)
-#define NEXT goto *dispatch_table[*ip]
+#if defined(__EDG__)
+#define DISPATCH goto invalid
+#else
+#define DISPATCH goto *dispatch_table[*ip]
+#endif
+
+#if defined(MANGO_PROFILE)
+#define NEXT                                                                   \
+  do {                                                                         \
+    if (profile)                                                               \
+      _mango_profile_step(profile, *ip);                                       \
+    DISPATCH;                                                                  \
+  } while (0)
+#define PROFILE_CALL(Module, Offset)                                           \
+  if (profile)                                                                 \
+  _mango_profile_call(profile, (Module), (Offset), sf.pop == 0 && *ip == RET)
+#define PROFILE_TAIL_CALL(Module, Offset)                                      \
+  if (profile)                                                                 \
+  _mango_profile_call(profile, (Module), (Offset), 1)
+#define PROFILE_RETURN                                                         \
+  if (profile)                                                                 \
+  _mango_profile_return(profile)
+#else
+#define NEXT DISPATCH
+#define PROFILE_CALL(Module, Offset)
+#define PROFILE_TAIL_CALL(Module, Offset)
+#define PROFILE_RETURN
+#endif
+
+#if defined(MANGO_JIT)
+#define ENTER(Module) ip = _mango_jit_resume(vm, (Module), ip, &sp, &fuel)
 #else
-#define NEXT goto invalid
+#define ENTER(Module)
+#endif
+
+#if defined(MANGO_JIT)
+#define LOOP ENTER(sf.module)
+#else
+#define LOOP
 #endif
 
 #define INVALID goto invalid
@@ -674,6 +4737,33 @@ int mango_syscall(const mango_vm *vm) { return vm ? vm->syscall : 0; }
   if (Condition)                                                               \
   goto done
 
+#if defined(MANGO_FOREIGN_SLICES)
+#define DEREF(Pointer, Ref, Extent)                                            \
+  if (((Ref).address & FOREIGN_BIT) == 0) {                                    \
+    Pointer = void_as_ptr(vm, (Ref));                                          \
+  } else {                                                                     \
+    Pointer = _mango_get_foreign(vm, (Ref), (Extent));                         \
+    RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, !(Pointer));                         \
+  }
+#else
+#define DEREF(Pointer, Ref, Extent) Pointer = void_as_ptr(vm, (Ref))
+#endif
+
+#if defined(MANGO_SAMPLING)
+#define PUBLISH(Ip) _mango_publish_frame(vm, sf, (Ip), rp)
+#define CHARGE_IF(Condition)                                                   \
+  if (Condition) {                                                             \
+    _mango_publish_ip(vm, (uint16_t)(ip - image));                             \
+    if (fuel-- == 0)                                                           \
+      goto timeout;                                                            \
+  }
+#else
+#define PUBLISH(Ip)
+#define CHARGE_IF(Condition)                                                   \
+  if ((Condition) && fuel-- == 0)                                              \
+  goto timeout
+#endif
+
 #define BINARY1(Type, Operator)                                                \
   do {                                                                         \
     sp[1].Type = sp[1].Type Operator sp[0].Type;                               \
@@ -815,27 +4905,220 @@ int mango_syscall(const mango_vm *vm) { return vm ? vm->syscall : 0; }
     NEXT;                                                                      \
   } while (0)
 
-#define COMPARE2(Type, Operator)                                               \
-  do {                                                                         \
-    stackval2 *sp2 = (stackval2 *)sp;                                          \
-    int tmp = sp2[1].Type Operator sp2[0].Type;                                \
-    sp += 3;                                                                   \
-    sp[0].i32 = tmp;                                                           \
-    ip++;                                                                      \
-    NEXT;                                                                      \
-  } while (0)
+#define COMPARE2(Type, Operator)                                               \
+  do {                                                                         \
+    stackval2 *sp2 = (stackval2 *)sp;                                          \
+    int tmp = sp2[1].Type Operator sp2[0].Type;                                \
+    sp += 3;                                                                   \
+    sp[0].i32 = tmp;                                                           \
+    ip++;                                                                      \
+    NEXT;                                                                      \
+  } while (0)
+
+#define COMPARE2F(Type, Operator)                                              \
+  do {                                                                         \
+    stackval2 *sp2 = (stackval2 *)sp;                                          \
+    int tmp = Operator(sp2[1].Type, sp2[0].Type);                              \
+    sp += 3;                                                                   \
+    sp[0].i32 = tmp;                                                           \
+    ip++;                                                                      \
+    NEXT;                                                                      \
+  } while (0)
+
+#pragma endregion
+
+#if defined(MANGO_JIT)
+// Continues in native code if there is any for the instruction at `ip`, and
+// returns the instruction at which native code handed back control.
+static inline const uint8_t *_mango_jit_resume(mango_vm *vm, uint8_t module,
+                                               const uint8_t *ip,
+                                               stackval **sp, uint32_t *fuel) {
+  const uint8_t *code;
+  const int32_t *cells = _mango_get_module_jit(vm, module, &code);
+  const uint8_t *image = _mango_get_module(vm, module)->image;
+
+  if (cells && cells[ip - image] > 0) {
+    jit_function f;
+    const uint8_t *entry = code + cells[ip - image];
+    memcpy(&f, &entry, sizeof(f));
+    jit_exit e = f(*sp, vm, fuel);
+    *sp = e.sp;
+    ip = image + e.ip;
+  }
+
+  return ip;
+}
+#endif
+
+#if !defined(MANGO_NO_REFS)
+// Returns the `length * size` bytes at `ref`, or NULL if they are not all
+// inside the heap.
+static inline void *_mango_get_block(const mango_vm *vm, void_ref ref,
+                                     uint32_t length, uint32_t size) {
+#if defined(MANGO_FOREIGN_SLICES)
+  if ((ref.address & FOREIGN_BIT) != 0) {
+    return _mango_get_foreign(vm, ref, (uint64_t)length * size);
+  }
+#endif
+  uintptr_t offset = (uintptr_t)void_as_ptr(vm, ref) - (uintptr_t)vm;
+  uint64_t end = (uint64_t)offset + (uint64_t)length * size;
+  return end <= vm->heap_size ? void_as_ptr(vm, ref) : NULL;
+}
+
+// Vector kernels are plain loops for the compiler to vectorize. On x86-64
+// Linux each one is also built for AVX2 and selected at load time by CPUID,
+// unless MANGO_NO_TARGET_CLONES is defined. Float reductions keep a fixed
+// number of partial results, so every build adds the elements in the same
+// order and gets the same result.
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute) &&  \
+    !defined(MANGO_NO_TARGET_CLONES)
+#if __has_attribute(target_clones)
+#define VECTOR_KERNEL __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+#if !defined(VECTOR_KERNEL)
+#define VECTOR_KERNEL
+#endif
+
+#define VECTOR_LANES 8
+
+VECTOR_KERNEL static void _mango_vadd_i32(uint32_t *d, const uint32_t *a,
+                                          const uint32_t *b, uint32_t n) {
+  for (size_t i = 0; i < n; i++) {
+    d[i] = a[i] + b[i];
+  }
+}
+
+VECTOR_KERNEL static void _mango_vmul_i32(uint32_t *d, const uint32_t *a,
+                                          const uint32_t *b, uint32_t n) {
+  for (size_t i = 0; i < n; i++) {
+    d[i] = a[i] * b[i];
+  }
+}
+
+VECTOR_KERNEL static uint32_t _mango_vsum_i32(const uint32_t *a, uint32_t n) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += a[i];
+  }
+  return sum;
+}
+
+VECTOR_KERNEL static uint32_t _mango_vdot_i32(const uint32_t *a,
+                                              const uint32_t *b, uint32_t n) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+#if !defined(MANGO_NO_F32)
+
+VECTOR_KERNEL static void _mango_vadd_f32(float *d, const float *a,
+                                          const float *b, uint32_t n) {
+  for (size_t i = 0; i < n; i++) {
+    d[i] = a[i] + b[i];
+  }
+}
+
+VECTOR_KERNEL static void _mango_vmul_f32(float *d, const float *a,
+                                          const float *b, uint32_t n) {
+  for (size_t i = 0; i < n; i++) {
+    d[i] = a[i] * b[i];
+  }
+}
+
+VECTOR_KERNEL static void _mango_vmad_f32(float *d, const float *a,
+                                          const float *b, uint32_t n) {
+  for (size_t i = 0; i < n; i++) {
+    d[i] += a[i] * b[i];
+  }
+}
+
+VECTOR_KERNEL static float _mango_vdot_f32(const float *a, const float *b,
+                                           uint32_t n) {
+  float lanes[VECTOR_LANES] = {0};
+  size_t i = 0;
+  for (; n - i >= VECTOR_LANES; i += VECTOR_LANES) {
+    for (uint_fast8_t k = 0; k < VECTOR_LANES; k++) {
+      lanes[k] += a[i + k] * b[i + k];
+    }
+  }
+  float sum = 0;
+  for (uint_fast8_t k = 0; k < VECTOR_LANES; k++) {
+    sum += lanes[k];
+  }
+  for (; i < n; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+VECTOR_KERNEL static float _mango_vsum_f32(const float *a, uint32_t n) {
+  float lanes[VECTOR_LANES] = {0};
+  size_t i = 0;
+  for (; n - i >= VECTOR_LANES; i += VECTOR_LANES) {
+    for (uint_fast8_t k = 0; k < VECTOR_LANES; k++) {
+      lanes[k] += a[i + k];
+    }
+  }
+  float sum = 0;
+  for (uint_fast8_t k = 0; k < VECTOR_LANES; k++) {
+    sum += lanes[k];
+  }
+  for (; i < n; i++) {
+    sum += a[i];
+  }
+  return sum;
+}
+
+VECTOR_KERNEL static float _mango_vmin_f32(const float *a, uint32_t n) {
+  float lanes[VECTOR_LANES];
+  size_t i = 0;
+  for (uint_fast8_t k = 0; k < VECTOR_LANES; k++) {
+    lanes[k] = INFINITY;
+  }
+  for (; n - i >= VECTOR_LANES; i += VECTOR_LANES) {
+    for (uint_fast8_t k = 0; k < VECTOR_LANES; k++) {
+      lanes[k] = a[i + k] < lanes[k] ? a[i + k] : lanes[k];
+    }
+  }
+  float min = INFINITY;
+  for (uint_fast8_t k = 0; k < VECTOR_LANES; k++) {
+    min = lanes[k] < min ? lanes[k] : min;
+  }
+  for (; i < n; i++) {
+    min = a[i] < min ? a[i] : min;
+  }
+  return min;
+}
 
-#define COMPARE2F(Type, Operator)                                              \
-  do {                                                                         \
-    stackval2 *sp2 = (stackval2 *)sp;                                          \
-    int tmp = Operator(sp2[1].Type, sp2[0].Type);                              \
-    sp += 3;                                                                   \
-    sp[0].i32 = tmp;                                                           \
-    ip++;                                                                      \
-    NEXT;                                                                      \
-  } while (0)
+VECTOR_KERNEL static float _mango_vmax_f32(const float *a, uint32_t n) {
+  float lanes[VECTOR_LANES];
+  size_t i = 0;
+  for (uint_fast8_t k = 0; k < VECTOR_LANES; k++) {
+    lanes[k] = -INFINITY;
+  }
+  for (; n - i >= VECTOR_LANES; i += VECTOR_LANES) {
+    for (uint_fast8_t k = 0; k < VECTOR_LANES; k++) {
+      lanes[k] = a[i + k] > lanes[k] ? a[i + k] : lanes[k];
+    }
+  }
+  float max = -INFINITY;
+  for (uint_fast8_t k = 0; k < VECTOR_LANES; k++) {
+    max = lanes[k] > max ? lanes[k] : max;
+  }
+  for (; i < n; i++) {
+    max = a[i] > max ? a[i] : max;
+  }
+  return max;
+}
 
-#pragma endregion
+#endif
+
+#endif
 
 static mango_result _mango_interpret(mango_vm *vm) {
   static const void *const dispatch_table[] = {
@@ -848,8 +5131,22 @@ static mango_result _mango_interpret(mango_vm *vm) {
   stackval *rp = vm->stack + vm->rp;
   stackval *sp = vm->stack + vm->sp;
   stack_frame sf = vm->sf;
-  const uint8_t *ip = _mango_get_module(vm, sf.module)->image + sf.ip;
+  const mango_module *modules = _mango_get_modules(vm);
+  const uint8_t *image = modules[sf.module].image;
+  const uint8_t *imports = _mango_get_module_imports(vm, &modules[sf.module]);
+  const uint8_t *ip = image + sf.ip;
+  uint32_t fuel = vm->fuel;
+  int verified = (modules[0].init_flags & VERIFIED) != 0;
+#if defined(MANGO_PROFILE)
+  profile_buffer *profile = _mango_get_profile(vm);
+#endif
 
+  ENTER(sf.module);
+#if defined(MANGO_PROFILE)
+  if (vm->result == MANGO_E_TIMEOUT) {
+    DISPATCH; // counted before running out of fuel
+  }
+#endif
   NEXT;
 
 #pragma region basic
@@ -996,18 +5293,15 @@ STLOC_X32: // value ... -> ...
 STLOC_X64: // value ... -> ...
   do {
     uint8_t slot = FETCH(ip + 1, u8);
-    sp[slot + 0].u32 = sp[0].u32;
-    sp[slot + 1].u32 = sp[1].u32;
+    uint32_t value1 = sp[0].u32;
+    uint32_t value2 = sp[1].u32;
+    sp[slot + 0].u32 = value1;
+    sp[slot + 1].u32 = value2;
     sp += 2;
     ip += 2;
     NEXT;
   } while (0);
 
-UNUSED21:
-UNUSED22:
-UNUSED23:
-  INVALID;
-
 #pragma endregion
 
 #pragma region calls
@@ -1019,19 +5313,23 @@ RET_X32: // value ... -> ...
   sp[sf.pop + 0].u32 = sp[0].u32;
 
 RET: // ... -> ...
+  PROFILE_RETURN;
   sp += sf.pop;
   --rp;
   sf = rp->sf;
-  ip = _mango_get_module(vm, sf.module)->image + sf.ip;
+  image = modules[sf.module].image;
+  imports = _mango_get_module_imports(vm, &modules[sf.module]);
+  ip = image + sf.ip;
+  PUBLISH(sf.ip);
+  ENTER(sf.module);
   NEXT;
 
 CALLI: // ftn argumentN ... argument1 argument0 ... -> result ...
+  CHARGE_IF(1);
   do {
     uint8_t module = sp[0].ftn.module;
     uint16_t offset = sp[0].ftn.offset;
 
-    const mango_module *modules = _mango_get_modules(vm);
-    const mango_module *caller = modules + sf.module;
     const mango_module *callee = modules + module;
     const mango_func_def *f = (const mango_func_def *)(callee->image + offset);
 
@@ -1040,14 +5338,18 @@ CALLI: // ftn argumentN ... argument1 argument0 ... -> result ...
     sp++;
     ip++;
 
+    PROFILE_CALL(module, offset);
     if (!(sf.pop == 0 && *ip == RET)) {
-      rp->sf = (stack_frame){sf.pop, sf.module, (uint16_t)(ip - caller->image)};
+      rp->sf = (stack_frame){sf.pop, sf.module, (uint16_t)(ip - image)};
       rp++;
     }
 
     sf = (stack_frame){(uint8_t)(f->arg_count + f->loc_count), module, 0};
     sp -= f->loc_count;
+    image = callee->image;
+    imports = _mango_get_module_imports(vm, callee);
     ip = f->code;
+    PUBLISH((uint16_t)(ip - image));
 
     if (f->loc_count != 0) {
       for (uint_fast8_t i = 0, n = f->loc_count; i < n; i++) {
@@ -1055,30 +5357,31 @@ CALLI: // ftn argumentN ... argument1 argument0 ... -> result ...
       }
     }
 
+    ENTER(module);
     NEXT;
   } while (0);
 
 CALL_S: // argumentN ... argument1 argument0 ... -> result ...
+  CHARGE_IF(1);
   do {
     uint16_t offset = FETCH(ip + 1, u16);
 
-    const mango_module *modules = _mango_get_modules(vm);
-    const mango_module *caller = modules + sf.module;
-    const mango_module *callee = modules + sf.module;
-    const mango_func_def *f = (const mango_func_def *)(callee->image + offset);
+    const mango_func_def *f = (const mango_func_def *)(image + offset);
 
     RETURN_IF(MANGO_E_STACK_OVERFLOW,
               sp - rp < 1 + f->loc_count + f->max_stack);
     ip += 3;
 
+    PROFILE_CALL(sf.module, offset);
     if (!(sf.pop == 0 && *ip == RET)) {
-      rp->sf = (stack_frame){sf.pop, sf.module, (uint16_t)(ip - caller->image)};
+      rp->sf = (stack_frame){sf.pop, sf.module, (uint16_t)(ip - image)};
       rp++;
     }
 
     sf = (stack_frame){(uint8_t)(f->arg_count + f->loc_count), sf.module, 0};
     sp -= f->loc_count;
     ip = f->code;
+    PUBLISH((uint16_t)(ip - image));
 
     if (f->loc_count != 0) {
       for (uint_fast8_t i = 0, n = f->loc_count; i < n; i++) {
@@ -1086,19 +5389,17 @@ CALL_S: // argumentN ... argument1 argument0 ... -> result ...
       }
     }
 
+    ENTER(sf.module);
     NEXT;
   } while (0);
 
 CALL: // argumentN ... argument1 argument0 ... -> result ...
+  CHARGE_IF(1);
   do {
     uint8_t import = FETCH(ip + 1, u8);
     uint16_t offset = FETCH(ip + 2, u16);
 
-    const mango_module *modules = _mango_get_modules(vm);
-    const mango_module *caller = modules + sf.module;
-    uint8_t module = import == INVALID_MODULE
-                         ? sf.module
-                         : _mango_get_module_imports(vm, caller)[import];
+    uint8_t module = import == INVALID_MODULE ? sf.module : imports[import];
     const mango_module *callee = modules + module;
     const mango_func_def *f = (const mango_func_def *)(callee->image + offset);
 
@@ -1106,14 +5407,125 @@ CALL: // argumentN ... argument1 argument0 ... -> result ...
               sp - rp < 1 + f->loc_count + f->max_stack);
     ip += 4;
 
+    PROFILE_CALL(module, offset);
     if (!(sf.pop == 0 && *ip == RET)) {
-      rp->sf = (stack_frame){sf.pop, sf.module, (uint16_t)(ip - caller->image)};
+      rp->sf = (stack_frame){sf.pop, sf.module, (uint16_t)(ip - image)};
       rp++;
     }
 
     sf = (stack_frame){(uint8_t)(f->arg_count + f->loc_count), module, 0};
     sp -= f->loc_count;
+    image = callee->image;
+    imports = _mango_get_module_imports(vm, callee);
+    ip = f->code;
+    PUBLISH((uint16_t)(ip - image));
+
+    if (f->loc_count != 0) {
+      for (uint_fast8_t i = 0, n = f->loc_count; i < n; i++) {
+        sp[i].u32 = 0;
+      }
+    }
+
+    ENTER(module);
+    NEXT;
+  } while (0);
+
+// Tail calls move the arguments over the arguments and locals of the caller,
+// whose frame is replaced by the frame of the callee. The callee returns to
+// where the caller would have returned to.
+
+TAIL_CALLI: // ftn argumentN ... argument1 argument0 -> result
+  CHARGE_IF(1);
+  do {
+    uint8_t module = sp[0].ftn.module;
+    uint16_t offset = sp[0].ftn.offset;
+
+    const mango_module *callee = modules + module;
+    const mango_func_def *f = (const mango_func_def *)(callee->image + offset);
+
+    sp++;
+    RETURN_IF(MANGO_E_STACK_OVERFLOW,
+              sp + sf.pop - rp < f->loc_count + f->max_stack);
+
+    PROFILE_TAIL_CALL(module, offset);
+    for (uint_fast8_t i = f->arg_count; i-- != 0;) {
+      sp[sf.pop + i].u32 = sp[i].u32;
+    }
+
+    sp += sf.pop;
+    sf = (stack_frame){(uint8_t)(f->arg_count + f->loc_count), module, 0};
+    sp -= f->loc_count;
+    image = callee->image;
+    imports = _mango_get_module_imports(vm, callee);
+    ip = f->code;
+    PUBLISH((uint16_t)(ip - image));
+
+    if (f->loc_count != 0) {
+      for (uint_fast8_t i = 0, n = f->loc_count; i < n; i++) {
+        sp[i].u32 = 0;
+      }
+    }
+
+    ENTER(module);
+    NEXT;
+  } while (0);
+
+TAIL_CALL_S: // argumentN ... argument1 argument0 -> result
+  CHARGE_IF(1);
+  do {
+    uint16_t offset = FETCH(ip + 1, u16);
+
+    const mango_func_def *f = (const mango_func_def *)(image + offset);
+
+    RETURN_IF(MANGO_E_STACK_OVERFLOW,
+              sp + sf.pop - rp < f->loc_count + f->max_stack);
+
+    PROFILE_TAIL_CALL(sf.module, offset);
+    for (uint_fast8_t i = f->arg_count; i-- != 0;) {
+      sp[sf.pop + i].u32 = sp[i].u32;
+    }
+
+    sp += sf.pop;
+    sf = (stack_frame){(uint8_t)(f->arg_count + f->loc_count), sf.module, 0};
+    sp -= f->loc_count;
+    ip = f->code;
+    PUBLISH((uint16_t)(ip - image));
+
+    if (f->loc_count != 0) {
+      for (uint_fast8_t i = 0, n = f->loc_count; i < n; i++) {
+        sp[i].u32 = 0;
+      }
+    }
+
+    ENTER(sf.module);
+    NEXT;
+  } while (0);
+
+TAIL_CALL: // argumentN ... argument1 argument0 -> result
+  CHARGE_IF(1);
+  do {
+    uint8_t import = FETCH(ip + 1, u8);
+    uint16_t offset = FETCH(ip + 2, u16);
+
+    uint8_t module = import == INVALID_MODULE ? sf.module : imports[import];
+    const mango_module *callee = modules + module;
+    const mango_func_def *f = (const mango_func_def *)(callee->image + offset);
+
+    RETURN_IF(MANGO_E_STACK_OVERFLOW,
+              sp + sf.pop - rp < f->loc_count + f->max_stack);
+
+    PROFILE_TAIL_CALL(module, offset);
+    for (uint_fast8_t i = f->arg_count; i-- != 0;) {
+      sp[sf.pop + i].u32 = sp[i].u32;
+    }
+
+    sp += sf.pop;
+    sf = (stack_frame){(uint8_t)(f->arg_count + f->loc_count), module, 0};
+    sp -= f->loc_count;
+    image = callee->image;
+    imports = _mango_get_module_imports(vm, callee);
     ip = f->code;
+    PUBLISH((uint16_t)(ip - image));
 
     if (f->loc_count != 0) {
       for (uint_fast8_t i = 0, n = f->loc_count; i < n; i++) {
@@ -1121,6 +5533,7 @@ CALL: // argumentN ... argument1 argument0 ... -> result ...
       }
     }
 
+    ENTER(module);
     NEXT;
   } while (0);
 
@@ -1128,6 +5541,32 @@ SYSCALL: // argumentN ... argument1 argument0 ... -> result ...
   do {
     int8_t adjustment = FETCH(ip + 1, i8);
     uint16_t syscall = FETCH(ip + 2, u16);
+    mango_syscall_func function = _mango_get_syscall_func(vm, syscall);
+
+    // A verified SYSCALL pushes its results within the max_stack reserved
+    // by the CALL of the current function.
+    RETURN_IF(MANGO_E_STACK_OVERFLOW,
+              adjustment < 0 && !verified && sp - rp < -adjustment);
+
+    if (function) {
+      // for mango_module_context and mango_stack_top
+#if !defined(MANGO_SAMPLING)
+      vm->sf = sf;
+      vm->rp = (uint16_t)(rp - vm->stack);
+#endif
+      vm->sp = (uint16_t)(sp - vm->stack);
+      result = function(vm, sp, sp + adjustment);
+      if (result == MANGO_E_SUCCESS) {
+        ip += 4;
+        sp += adjustment;
+        NEXT;
+      }
+      if (result != MANGO_E_SYSTEM_CALL) {
+        // Breakpoints and timeouts belong to the VM, not to the function.
+        RETURN(result < MANGO_E_BREAKPOINT ? result
+                                           : MANGO_E_INVALID_OPERATION);
+      }
+    }
 
     ip += 4;
     vm->sp_expected = (uint16_t)((sp - vm->stack) + adjustment);
@@ -1144,37 +5583,45 @@ UNUSED31:
 #pragma region branches
 
 BR_S: // ... -> ...
+  CHARGE_IF(FETCH(ip + 1, i8) < 0);
   ip += 2 + FETCH(ip + 1, i8);
+  LOOP;
   NEXT;
 
 BRFALSE_S: // value ... -> ...
+  CHARGE_IF(sp[0].u32 == 0 && FETCH(ip + 1, i8) < 0);
   ip += 2 + (sp[0].u32 == 0 ? FETCH(ip + 1, i8) : 0);
   sp++;
+  LOOP;
   NEXT;
 
 BRTRUE_S: // value ... -> ...
+  CHARGE_IF(sp[0].u32 != 0 && FETCH(ip + 1, i8) < 0);
   ip += 2 + (sp[0].u32 != 0 ? FETCH(ip + 1, i8) : 0);
   sp++;
+  LOOP;
   NEXT;
 
 BR: // ... -> ...
+  CHARGE_IF(FETCH(ip + 1, i16) < 0);
   ip += 3 + FETCH(ip + 1, i16);
+  LOOP;
   NEXT;
 
 BRFALSE: // value ... -> ...
+  CHARGE_IF(sp[0].u32 == 0 && FETCH(ip + 1, i16) < 0);
   ip += 3 + (sp[0].u32 == 0 ? FETCH(ip + 1, i16) : 0);
   sp++;
+  LOOP;
   NEXT;
 
 BRTRUE: // value ... -> ...
+  CHARGE_IF(sp[0].u32 != 0 && FETCH(ip + 1, i16) < 0);
   ip += 3 + (sp[0].u32 != 0 ? FETCH(ip + 1, i16) : 0);
   sp++;
+  LOOP;
   NEXT;
 
-UNUSED38:
-UNUSED39:
-  INVALID;
-
 #pragma endregion
 
 #pragma region constants
@@ -1218,10 +5665,7 @@ LDFTN: // ... -> ftn ...
     uint8_t import = FETCH(ip + 1, u8);
     uint16_t offset = FETCH(ip + 2, u16);
 
-    uint8_t module = import == INVALID_MODULE
-                         ? sf.module
-                         : _mango_get_module_imports(
-                               vm, _mango_get_module(vm, sf.module))[import];
+    uint8_t module = import == INVALID_MODULE ? sf.module : imports[import];
 
     sp--;
     sp[0].ftn = (function_token){0, module, offset};
@@ -1229,19 +5673,139 @@ LDFTN: // ... -> ftn ...
     NEXT;
   } while (0);
 
-UNUSED54:
-UNUSED55:
-  INVALID;
+#pragma endregion
 
-UNUSED56:
-UNUSED57:
-UNUSED58:
-UNUSED59:
-UNUSED60:
-UNUSED61:
-UNUSED62:
-UNUSED63:
-  INVALID;
+#pragma region superinstructions
+
+#define COMPARE_BRANCH(Type, Operator)                                         \
+  do {                                                                         \
+    int taken = sp[1].Type Operator sp[0].Type;                                \
+    CHARGE_IF(taken && FETCH(ip + 2, i8) < 0);                                 \
+    ip += 3 + (taken ? FETCH(ip + 2, i8) : 0);                                 \
+    sp += 2;                                                                   \
+    LOOP;                                                                      \
+    NEXT;                                                                      \
+  } while (0)
+
+LDLOC2_X32: // ... -> value1 value2 ...
+  do {
+    uint32_t value1 = sp[FETCH(ip + 1, u8)].u32;
+    uint32_t value2 = sp[FETCH(ip + 3, u8) - 1].u32;
+    sp -= 2;
+    sp[0].u32 = value2;
+    sp[1].u32 = value1;
+    ip += 4;
+    NEXT;
+  } while (0);
+
+ADDLOC_I32_S: // ... -> ...
+  do {
+    uint32_t value = sp[FETCH(ip + 1, u8)].u32 + (uint32_t)FETCH(ip + 3, i8);
+    sp[FETCH(ip + 6, u8) - 1].u32 = value;
+    ip += 7;
+    NEXT;
+  } while (0);
+
+BEQ_I32_S: // value2 value1 ... -> ...
+  COMPARE_BRANCH(u32, ==);
+
+BNE_I32_S: // value2 value1 ... -> ...
+  COMPARE_BRANCH(u32, !=);
+
+BGT_I32_S: // value2 value1 ... -> ...
+  COMPARE_BRANCH(i32, >);
+
+BGT_I32_UN_S: // value2 value1 ... -> ...
+  COMPARE_BRANCH(u32, >);
+
+BGE_I32_S: // value2 value1 ... -> ...
+  COMPARE_BRANCH(i32, >=);
+
+BGE_I32_UN_S: // value2 value1 ... -> ...
+  COMPARE_BRANCH(u32, >=);
+
+BLT_I32_S: // value2 value1 ... -> ...
+  COMPARE_BRANCH(i32, <);
+
+BLT_I32_UN_S: // value2 value1 ... -> ...
+  COMPARE_BRANCH(u32, <);
+
+BLE_I32_S: // value2 value1 ... -> ...
+  COMPARE_BRANCH(i32, <=);
+
+BLE_I32_UN_S: // value2 value1 ... -> ...
+  COMPARE_BRANCH(u32, <=);
+
+CALL_M: // argumentN ... argument1 argument0 ... -> result ...
+  CHARGE_IF(1);
+  do {
+    uint8_t module = FETCH(ip + 1, u8);
+    uint16_t offset = FETCH(ip + 2, u16);
+
+    const mango_module *callee = modules + module;
+    const mango_func_def *f = (const mango_func_def *)(callee->image + offset);
+
+    RETURN_IF(MANGO_E_STACK_OVERFLOW,
+              sp - rp < 1 + f->loc_count + f->max_stack);
+    ip += 4;
+
+    PROFILE_CALL(module, offset);
+    if (!(sf.pop == 0 && *ip == RET)) {
+      rp->sf = (stack_frame){sf.pop, sf.module, (uint16_t)(ip - image)};
+      rp++;
+    }
+
+    sf = (stack_frame){(uint8_t)(f->arg_count + f->loc_count), module, 0};
+    sp -= f->loc_count;
+    image = callee->image;
+    imports = _mango_get_module_imports(vm, callee);
+    ip = f->code;
+    PUBLISH((uint16_t)(ip - image));
+
+    if (f->loc_count != 0) {
+      for (uint_fast8_t i = 0, n = f->loc_count; i < n; i++) {
+        sp[i].u32 = 0;
+      }
+    }
+
+    ENTER(module);
+    NEXT;
+  } while (0);
+
+TAIL_CALL_M: // argumentN ... argument1 argument0 -> result
+  CHARGE_IF(1);
+  do {
+    uint8_t module = FETCH(ip + 1, u8);
+    uint16_t offset = FETCH(ip + 2, u16);
+
+    const mango_module *callee = modules + module;
+    const mango_func_def *f = (const mango_func_def *)(callee->image + offset);
+
+    RETURN_IF(MANGO_E_STACK_OVERFLOW,
+              sp + sf.pop - rp < f->loc_count + f->max_stack);
+
+    PROFILE_TAIL_CALL(module, offset);
+    for (uint_fast8_t i = f->arg_count; i-- != 0;) {
+      sp[sf.pop + i].u32 = sp[i].u32;
+    }
+
+    sp += sf.pop;
+    sf = (stack_frame){(uint8_t)(f->arg_count + f->loc_count), module, 0};
+    sp -= f->loc_count;
+    image = callee->image;
+    imports = _mango_get_module_imports(vm, callee);
+    ip = f->code;
+    PUBLISH((uint16_t)(ip - image));
+
+    if (f->loc_count != 0) {
+      for (uint_fast8_t i = 0, n = f->loc_count; i < n; i++) {
+        sp[i].u32 = 0;
+      }
+    }
+
+    ENTER(module);
+    NEXT;
+  } while (0);
 
 #pragma endregion
 
@@ -1346,8 +5910,6 @@ CONV_I16_I32: // value ... -> result ...
 CONV_U16_I32: // value ... -> result ...
   CONVERT1(uint16_t, u32, u32);
 
-UNUSED93:
-UNUSED94:
 UNUSED95:
   INVALID;
 
@@ -1407,17 +5969,60 @@ SLICE2: // length' start array length ... -> array length' ...
     NEXT;
   } while (0);
 
-UNUSED100:
-UNUSED101:
-UNUSED102:
+// Bulk operations take the element size as operand and check the whole
+// block once against the heap.
+
+CPBLK: // array' length' array length ... -> ...
+  do {
+    uint32_t size = FETCH(ip + 1, u16);
+    RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, sp[1].u32 > sp[3].u32);
+    const void *source = _mango_get_block(vm, sp[0].ref, sp[1].u32, size);
+    void *destination = _mango_get_block(vm, sp[2].ref, sp[1].u32, size);
+    RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, !source || !destination);
+    memmove(destination, source, (size_t)sp[1].u32 * size);
+    sp += 4;
+    ip += 3;
+    NEXT;
+  } while (0);
+
+INITBLK: // value array length ... -> ...
+  do {
+    uint32_t size = FETCH(ip + 1, u16);
+    void *block = _mango_get_block(vm, sp[1].ref, sp[2].u32, size);
+    RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, !block);
+    memset(block, (uint8_t)sp[0].u32, (size_t)sp[2].u32 * size);
+    sp += 3;
+    ip += 3;
+    NEXT;
+  } while (0);
+
+CMPBLK: // array' length' array length ... -> result ...
+  do {
+    uint32_t size = FETCH(ip + 1, u16);
+    uint32_t length = sp[1].u32 < sp[3].u32 ? sp[1].u32 : sp[3].u32;
+    const void *block2 = _mango_get_block(vm, sp[0].ref, length, size);
+    const void *block1 = _mango_get_block(vm, sp[2].ref, length, size);
+    RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, !block1 || !block2);
+    int value = memcmp(block1, block2, (size_t)length * size);
+    if (value == 0) {
+      value = (sp[3].u32 > sp[1].u32) - (sp[3].u32 < sp[1].u32);
+    }
+    sp += 3;
+    sp[0].i32 = (value > 0) - (value < 0);
+    ip += 3;
+    NEXT;
+  } while (0);
+
 UNUSED103:
   INVALID;
 
 #define LOAD_FIELD(Cast, Type)                                                 \
   do {                                                                         \
     RETURN_IF(MANGO_E_NULL_REFERENCE, void_is_null(sp[0].ref));                \
-    uintptr_t object = (uintptr_t)(void_as_ptr(vm, sp[0].ref));                \
-    const Cast *field = (const Cast *)(object + FETCH(ip + 1, u16));           \
+    uint32_t offset = FETCH(ip + 1, u16);                                      \
+    const uint8_t *object;                                                     \
+    DEREF(object, sp[0].ref, offset + sizeof(Cast));                           \
+    const Cast *field = (const Cast *)(object + offset);                       \
     sp[0].Type = field[0];                                                     \
     ip += 3;                                                                   \
     NEXT;                                                                      \
@@ -1441,8 +6046,10 @@ LDFLD_X32: // address ... -> value ...
 LDFLD_X64: // address ... -> value ...
   do {
     RETURN_IF(MANGO_E_NULL_REFERENCE, void_is_null(sp[0].ref));
-    uintptr_t object = (uintptr_t)(void_as_ptr(vm, sp[0].ref));
-    const uint32_t *field = (const uint32_t *)(object + FETCH(ip + 1, u16));
+    uint32_t offset = FETCH(ip + 1, u16);
+    const uint8_t *object;
+    DEREF(object, sp[0].ref, offset + 2 * sizeof(uint32_t));
+    const uint32_t *field = (const uint32_t *)(object + offset);
     sp--;
     sp[0].u32 = field[0];
     sp[1].u32 = field[1];
@@ -1461,8 +6068,10 @@ LDFLDA: // address ... -> address ...
 #define STORE_FIELD(Cast, Type)                                                \
   do {                                                                         \
     RETURN_IF(MANGO_E_NULL_REFERENCE, void_is_null(sp[1].ref));                \
-    uintptr_t object = (uintptr_t)(void_as_ptr(vm, sp[1].ref));                \
-    Cast *field = (Cast *)(object + FETCH(ip + 1, u16));                       \
+    uint32_t offset = FETCH(ip + 1, u16);                                      \
+    uint8_t *object;                                                           \
+    DEREF(object, sp[1].ref, offset + sizeof(Cast));                           \
+    Cast *field = (Cast *)(object + offset);                                   \
     field[0] = (Cast)sp[0].Type;                                               \
     sp += 2;                                                                   \
     ip += 3;                                                                   \
@@ -1481,8 +6090,10 @@ STFLD_X32: // value address ... -> ...
 STFLD_X64: // value address -> ...
   do {
     RETURN_IF(MANGO_E_NULL_REFERENCE, void_is_null(sp[2].ref));
-    uintptr_t object = (uintptr_t)(void_as_ptr(vm, sp[2].ref));
-    uint32_t *field = (uint32_t *)(object + FETCH(ip + 1, u16));
+    uint32_t offset = FETCH(ip + 1, u16);
+    uint8_t *object;
+    DEREF(object, sp[2].ref, offset + 2 * sizeof(uint32_t));
+    uint32_t *field = (uint32_t *)(object + offset);
     field[0] = sp[0].u32;
     field[1] = sp[1].u32;
     sp += 3;
@@ -1490,24 +6101,107 @@ STFLD_X64: // value address -> ...
     NEXT;
   } while (0);
 
-UNUSED115:
-UNUSED116:
-UNUSED117:
-UNUSED118:
-UNUSED119:
-UNUSED120:
-UNUSED121:
-UNUSED122:
-UNUSED123:
-UNUSED124:
-UNUSED125:
+// Vector operations work on whole slices of i32 or f32 elements. Both
+// operands of a binary operation must be as long as the destination.
+
+#define VECTOR_MAP(Kernel, Type)                                               \
+  do {                                                                         \
+    uint32_t length = sp[5].u32;                                               \
+    RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE,                                      \
+              sp[3].u32 != length || sp[1].u32 != length);                     \
+    Type *d = (Type *)_mango_get_block(vm, sp[4].ref, length, sizeof(Type));   \
+    const Type *a =                                                            \
+        (const Type *)_mango_get_block(vm, sp[2].ref, length, sizeof(Type));   \
+    const Type *b =                                                            \
+        (const Type *)_mango_get_block(vm, sp[0].ref, length, sizeof(Type));   \
+    RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, !d || !a || !b);                     \
+    Kernel(d, a, b, length);                                                   \
+    sp += 6;                                                                   \
+    ip++;                                                                      \
+    NEXT;                                                                      \
+  } while (0)
+
+#define VECTOR_REDUCE(Kernel, Type, Field)                                     \
+  do {                                                                         \
+    uint32_t length = sp[1].u32;                                               \
+    const Type *a =                                                            \
+        (const Type *)_mango_get_block(vm, sp[0].ref, length, sizeof(Type));   \
+    RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, !a);                                 \
+    sp += 1;                                                                   \
+    sp[0].Field = Kernel(a, length);                                           \
+    ip++;                                                                      \
+    NEXT;                                                                      \
+  } while (0)
+
+#define VECTOR_DOT(Kernel, Type, Field)                                        \
+  do {                                                                         \
+    uint32_t length = sp[3].u32;                                               \
+    RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, sp[1].u32 != length);                \
+    const Type *a =                                                            \
+        (const Type *)_mango_get_block(vm, sp[2].ref, length, sizeof(Type));   \
+    const Type *b =                                                            \
+        (const Type *)_mango_get_block(vm, sp[0].ref, length, sizeof(Type));   \
+    RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, !a || !b);                           \
+    sp += 3;                                                                   \
+    sp[0].Field = Kernel(a, b, length);                                        \
+    ip++;                                                                      \
+    NEXT;                                                                      \
+  } while (0)
+
+VADD_I32: // array2 length2 array1 length1 array length ... -> ...
+  VECTOR_MAP(_mango_vadd_i32, uint32_t);
+
+VMUL_I32: // array2 length2 array1 length1 array length ... -> ...
+  VECTOR_MAP(_mango_vmul_i32, uint32_t);
+
+VSUM_I32: // array length ... -> result ...
+  VECTOR_REDUCE(_mango_vsum_i32, uint32_t, u32);
+
+VDOT_I32: // array2 length2 array1 length1 ... -> result ...
+  VECTOR_DOT(_mango_vdot_i32, uint32_t, u32);
+
+#if !defined(MANGO_NO_F32)
+
+VADD_F32: // array2 length2 array1 length1 array length ... -> ...
+  VECTOR_MAP(_mango_vadd_f32, float);
+
+VMUL_F32: // array2 length2 array1 length1 array length ... -> ...
+  VECTOR_MAP(_mango_vmul_f32, float);
+
+VMAD_F32: // array2 length2 array1 length1 array length ... -> ...
+  VECTOR_MAP(_mango_vmad_f32, float);
+
+VSUM_F32: // array length ... -> result ...
+  VECTOR_REDUCE(_mango_vsum_f32, float, f32);
+
+VDOT_F32: // array2 length2 array1 length1 ... -> result ...
+  VECTOR_DOT(_mango_vdot_f32, float, f32);
+
+VMIN_F32: // array length ... -> result ...
+  VECTOR_REDUCE(_mango_vmin_f32, float, f32);
+
+VMAX_F32: // array length ... -> result ...
+  VECTOR_REDUCE(_mango_vmax_f32, float, f32);
+
+#else
+
+VADD_F32:
+VMUL_F32:
+VMAD_F32:
+VSUM_F32:
+VDOT_F32:
+VMIN_F32:
+VMAX_F32:
   INVALID;
 
+#endif
+
 #define LOAD_ELEMENT(Cast, Type)                                               \
   do {                                                                         \
     uint32_t index = sp[0].u32;                                                \
     RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, index >= sp[2].u32);                 \
-    const Cast *array = (const Cast *)void_as_ptr(vm, sp[1].ref);              \
+    const Cast *array;                                                         \
+    DEREF(array, sp[1].ref, (index + 1ull) * sizeof(Cast));                    \
     sp += 2;                                                                   \
     sp[0].Type = array[index];                                                 \
     ip++;                                                                      \
@@ -1533,7 +6227,8 @@ LDELEM_X64: // index array length ... -> value ...
   do {
     uint32_t index = sp[0].u32;
     RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, index >= sp[2].u32);
-    const uint32_t *array = (const uint32_t *)void_as_ptr(vm, sp[1].ref);
+    const uint32_t *array;
+    DEREF(array, sp[1].ref, (index + 1ull) * 2 * sizeof(uint32_t));
     sp += 1;
     sp[0].u32 = array[2 * index + 0];
     sp[1].u32 = array[2 * index + 1];
@@ -1557,7 +6252,8 @@ LDELEMA: // index array length ... -> address ...
   do {                                                                         \
     uint32_t index = sp[1].u32;                                                \
     RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, index >= sp[3].u32);                 \
-    Cast *array = (Cast *)void_as_ptr(vm, sp[2].ref);                          \
+    Cast *array;                                                               \
+    DEREF(array, sp[2].ref, (index + 1ull) * sizeof(Cast));                    \
     array[index] = (Cast)sp[0].u32;                                            \
     sp += 4;                                                                   \
     ip++;                                                                      \
@@ -1577,7 +6273,8 @@ STELEM_X64: // value index array length ... -> ...
   do {
     uint32_t index = sp[2].u32;
     RETURN_IF(MANGO_E_INDEX_OUT_OF_RANGE, index >= sp[4].u32);
-    uint32_t *array = (uint32_t *)void_as_ptr(vm, sp[3].ref);
+    uint32_t *array;
+    DEREF(array, sp[3].ref, (index + 1ull) * 2 * sizeof(uint32_t));
     array[2 * index + 0] = sp[0].u32;
     array[2 * index + 1] = sp[1].u32;
     sp += 5;
@@ -1602,9 +6299,9 @@ NEWOBJ:
 NEWARR:
 SLICE1:
 SLICE2:
-UNUSED100:
-UNUSED101:
-UNUSED102:
+CPBLK:
+INITBLK:
+CMPBLK:
 UNUSED103:
 LDFLD_I8:
 LDFLD_U8:
@@ -1617,17 +6314,17 @@ STFLD_X8:
 STFLD_X16:
 STFLD_X32:
 STFLD_X64:
-UNUSED115:
-UNUSED116:
-UNUSED117:
-UNUSED118:
-UNUSED119:
-UNUSED120:
-UNUSED121:
-UNUSED122:
-UNUSED123:
-UNUSED124:
-UNUSED125:
+VADD_I32:
+VMUL_I32:
+VSUM_I32:
+VDOT_I32:
+VADD_F32:
+VMUL_F32:
+VMAD_F32:
+VSUM_F32:
+VDOT_F32:
+VMIN_F32:
+VMAX_F32:
 LDELEM_I8:
 LDELEM_U8:
 LDELEM_I16:
@@ -2149,6 +6846,14 @@ UNUSED255:
 
 #endif
 
+timeout:
+  if (!vm->metered) {
+    DISPATCH;
+  }
+  fuel = 0;
+  result = MANGO_E_TIMEOUT;
+  goto done;
+
 invalid:
   result = MANGO_E_INVALID_PROGRAM;
 
@@ -2157,9 +6862,8 @@ done:
   vm->syscall = 0;
 
 yield:
-  vm->sf =
-      (stack_frame){sf.pop, sf.module,
-                    (uint16_t)(ip - _mango_get_module(vm, sf.module)->image)};
+  vm->fuel = fuel;
+  vm->sf = (stack_frame){sf.pop, sf.module, (uint16_t)(ip - image)};
   vm->rp = (uint16_t)(rp - vm->stack);
   vm->sp = (uint16_t)(sp - vm->stack);
   return result;
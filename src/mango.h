@@ -87,8 +87,42 @@ typedef enum mango_alloc_flags {
   MANGO_ALLOC_ZERO_MEMORY = 0x8,
 } mango_alloc_flags;
 
+typedef enum mango_profile_kind {
+  MANGO_PROFILE_STACKS = 0,
+  MANGO_PROFILE_CALLS = 1,
+  MANGO_PROFILE_OPCODES = 2,
+  MANGO_PROFILE_PAIRS = 3,
+} mango_profile_kind;
+
 typedef struct mango_vm mango_vm;
 
+typedef struct mango_registry mango_registry;
+
+typedef struct mango_module_image {
+  const uint8_t *fingerprint;
+  const uint8_t *image;
+  size_t size;
+  void *context;
+} mango_module_image;
+
+typedef struct mango_frame {
+  uint8_t module;
+  uint16_t offset;
+} mango_frame;
+
+typedef void *(*mango_rebase_func)(void *state, const void *pointer);
+
+// A native system call runs with the stack of the VM as it was at the
+// SYSCALL, so mango_stack_top returns its arguments. It must not call
+// mango_stack_alloc or mango_stack_free; results go through `results`.
+typedef mango_result (*mango_syscall_func)(mango_vm *vm, const void *arguments,
+                                           void *results);
+
+typedef struct mango_scheduler mango_scheduler;
+
+typedef int (*mango_schedule_func)(void *state, mango_vm *vm,
+                                   mango_result result);
+
 MANGO_API int mango_version_major(void);
 
 MANGO_API int mango_version_minor(void);
@@ -100,6 +134,8 @@ MANGO_API int mango_features(void);
 MANGO_API mango_vm *mango_initialize(void *address, size_t heap_size,
                                      size_t stack_size, void *context);
 
+MANGO_API void mango_release(mango_vm *vm);
+
 MANGO_API mango_result mango_error(mango_vm *vm, mango_result error);
 
 MANGO_API void *mango_context(const mango_vm *vm);
@@ -107,10 +143,24 @@ MANGO_API void *mango_context(const mango_vm *vm);
 MANGO_API void *mango_heap_alloc(mango_vm *vm, size_t count, size_t size,
                                  size_t alignment, int flags);
 
+MANGO_API mango_result mango_heap_assume_zeroed(mango_vm *vm);
+
+MANGO_API mango_result mango_heap_free(mango_vm *vm, void *block, size_t count,
+                                       size_t size);
+
+MANGO_API size_t mango_heap_mark(const mango_vm *vm);
+
+MANGO_API mango_result mango_heap_release(mango_vm *vm, size_t mark);
+
 MANGO_API size_t mango_heap_size(const mango_vm *vm);
 
 MANGO_API size_t mango_heap_available(const mango_vm *vm);
 
+MANGO_API mango_result mango_foreign_map(mango_vm *vm, int region, void *base,
+                                         size_t size, uint32_t *address);
+
+MANGO_API mango_result mango_foreign_unmap(mango_vm *vm, int region);
+
 MANGO_API void *mango_stack_alloc(mango_vm *vm, size_t size, int flags);
 
 MANGO_API mango_result mango_stack_free(mango_vm *vm, size_t size);
@@ -121,19 +171,115 @@ MANGO_API size_t mango_stack_size(const mango_vm *vm);
 
 MANGO_API size_t mango_stack_available(const mango_vm *vm);
 
+// Importing the last missing module (here, with mango_module_import_all or
+// with mango_registry_import) verifies and links the module graph. This
+// takes scratch heap of 9 bytes per image byte plus 8 bytes per module,
+// released once linking is done. The syscall site table (4 bytes per
+// SYSCALL) stays, as do the fused code (1 byte per image byte) in
+// MANGO_SUPERINSTRUCTIONS builds and the native entry cells (4 bytes per
+// image byte plus 8 bytes per module) in MANGO_JIT builds. If the heap runs
+// out, the import fails with MANGO_E_OUT_OF_MEMORY and so does every later
+// mango_run.
 MANGO_API mango_result mango_module_import(mango_vm *vm,
                                            const uint8_t *fingerprint,
                                            const uint8_t *image, size_t size,
                                            void *context);
 
+MANGO_API mango_result mango_module_import_all(mango_vm *vm,
+                                               const mango_module_image *images,
+                                               size_t count);
+
 MANGO_API const uint8_t *mango_module_missing(const mango_vm *vm);
 
+// Returns nonzero if the linked module graph was verified with known stack
+// heights everywhere. Code after a CALLI is only checked for well-formed
+// instructions, branch targets and callees.
+MANGO_API int mango_module_verified(const mango_vm *vm);
+
 MANGO_API void *mango_module_context(const mango_vm *vm);
 
+MANGO_API mango_registry *mango_registry_initialize(void *address, size_t size);
+
+MANGO_API mango_result mango_registry_import(mango_registry *registry,
+                                             const uint8_t *fingerprint,
+                                             const uint8_t *image, size_t size,
+                                             void *context);
+
+MANGO_API const uint8_t *mango_registry_missing(const mango_registry *registry);
+
+MANGO_API void mango_registry_release(mango_registry *registry);
+
+// Each VM that imports a registry gets its own copy of the module table
+// (32 bytes per module on 64-bit hosts, plus a fingerprint index of 2 bytes
+// per slot with at least two slots per module), the import tables (1 byte
+// per import), the syscall site table (4 bytes per SYSCALL) and, in
+// MANGO_JIT builds, the native entry cells (4 bytes per image byte plus 8
+// bytes per module). Images, fused code and native code are shared.
+MANGO_API mango_result mango_module_import_registry(
+    mango_vm *vm, const mango_registry *registry);
+
 MANGO_API mango_result mango_run(mango_vm *vm);
 
+MANGO_API mango_result mango_run_with_budget(mango_vm *vm, uint32_t fuel);
+
 MANGO_API int mango_syscall(const mango_vm *vm);
 
+MANGO_API mango_result mango_syscall_register(
+    mango_vm *vm, const mango_syscall_func *functions, size_t count);
+
+MANGO_API uint32_t mango_syscall_defer(mango_vm *vm);
+
+MANGO_API mango_result mango_syscall_complete(mango_vm *vm, uint32_t token,
+                                              const void *results, size_t size);
+
+MANGO_API size_t mango_scheduler_size(int workers, size_t capacity);
+
+MANGO_API mango_scheduler *mango_scheduler_create(void *address, size_t size,
+                                                  int workers, size_t capacity,
+                                                  uint32_t fuel,
+                                                  mango_schedule_func callback,
+                                                  void *state);
+
+MANGO_API mango_result mango_scheduler_submit(mango_scheduler *scheduler,
+                                              mango_vm *vm);
+
+MANGO_API void mango_scheduler_shutdown(mango_scheduler *scheduler);
+
+MANGO_API size_t mango_profile_size(size_t nodes);
+
+MANGO_API mango_result mango_profile_attach(mango_vm *vm, void *buffer,
+                                            size_t size);
+
+MANGO_API size_t mango_profile_dump(const mango_vm *vm, int kind, char *buffer,
+                                    size_t size);
+
+MANGO_API size_t mango_unwind(const mango_vm *vm, mango_frame *frames,
+                              size_t count);
+
+MANGO_API size_t mango_optimize_size(const mango_module_image *images,
+                                     size_t count);
+
+MANGO_API mango_result mango_optimize(const mango_module_image *images,
+                                      size_t count, void *address, size_t size,
+                                      mango_module_image *optimized);
+
+MANGO_API size_t mango_snapshot_size(const mango_vm *vm);
+
+MANGO_API mango_result mango_snapshot(const mango_vm *vm, void *address,
+                                      size_t size);
+
+MANGO_API mango_vm *mango_restore(void *address, size_t heap_size,
+                                  const void *snapshot, size_t size,
+                                  void *context, mango_rebase_func rebase,
+                                  void *state);
+
+MANGO_API int mango_template_create(const mango_vm *vm);
+
+MANGO_API mango_vm *mango_template_clone(int fd, void *context,
+                                         mango_rebase_func rebase, void *state);
+
+MANGO_API void mango_template_release(mango_vm *vm);
+
 ////////////////////////////////////////////////////////////////////////////////
 
 #if UINTPTR_MAX == UINT32_MAX
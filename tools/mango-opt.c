@@ -0,0 +1,193 @@
+/*
+ *  _____ _____ _____ _____ _____
+ * |     |  _  |   | |   __|     |
+ * | | | |     | | | |  |  |  |  |
+ * |_|_|_|__|__|_|___|_____|_____|
+ *
+ * Mango Virtual Machine 1.0-dev
+ *
+ * Copyright (c) 2019 Klaus Hartke
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "../src/mango.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// mango-opt rewrites the module images of a program into smaller ones:
+//
+//   mango-opt -o DIR STARTUP [MODULE...]
+//
+// The first image is the startup module. Every module it imports must be
+// given too, in a file named by its fingerprint in hex (24 digits), with any
+// extension. The optimized images are written to DIR under the same names.
+// Both the original and the optimized program are imported into a VM, so
+// images that fail verification are reported and nothing is written.
+
+#define MAX_MODULES 255
+#define HEAP_SIZE (1 << 24)
+#define STACK_SIZE (1 << 12)
+
+static uint8_t fingerprints[MAX_MODULES][12];
+
+static int parse_fingerprint(const char *path, uint8_t *fingerprint) {
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+
+  for (int i = 0; i < 24; i++) {
+    char c = name[i];
+    int digit = c >= '0' && c <= '9'   ? c - '0'
+                : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                       : -1;
+    if (digit < 0) {
+      return 0;
+    }
+    fingerprint[i / 2] = (uint8_t)(fingerprint[i / 2] << 4 | digit);
+  }
+  return name[24] == '\0' || name[24] == '.';
+}
+
+static uint8_t *read_file(const char *path, size_t *size) {
+  FILE *f = fopen(path, "rb");
+  uint8_t *data = malloc(UINT16_MAX + 1);
+
+  if (!f || !data) {
+    free(data);
+    if (f) {
+      fclose(f);
+    }
+    return NULL;
+  }
+
+  *size = fread(data, 1, UINT16_MAX + 1, f);
+  if (ferror(f) || *size > UINT16_MAX) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  return data;
+}
+
+static int write_file(const char *dir, const char *path, const uint8_t *data,
+                      size_t size) {
+  const char *name = strrchr(path, '/');
+  char *out = malloc(strlen(dir) + strlen(path) + 2);
+
+  if (!out) {
+    return 0;
+  }
+  sprintf(out, "%s/%s", dir, name ? name + 1 : path);
+
+  FILE *f = fopen(out, "wb");
+  int ok = f && fwrite(data, 1, size, f) == size;
+  if (f && fclose(f) != 0) {
+    ok = 0;
+  }
+  if (!ok) {
+    fprintf(stderr, "mango-opt: cannot write %s\n", out);
+  }
+  free(out);
+  return ok;
+}
+
+static mango_result verify(const mango_module_image *images, size_t count) {
+  void *memory = malloc(HEAP_SIZE);
+  mango_vm *vm = memory ? mango_initialize(memory, HEAP_SIZE, STACK_SIZE, NULL)
+                        : NULL;
+  mango_result result = vm ? mango_module_import_all(vm, images, count)
+                           : MANGO_E_OUT_OF_MEMORY;
+  free(memory);
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  mango_module_image images[MAX_MODULES];
+  mango_module_image optimized[MAX_MODULES];
+  size_t count = (size_t)(argc - 3);
+  mango_result result;
+
+  if (argc < 4 || strcmp(argv[1], "-o") != 0 || count > MAX_MODULES) {
+    fprintf(stderr, "usage: mango-opt -o DIR STARTUP [MODULE...]\n");
+    return 2;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    const char *path = argv[3 + i];
+    uint8_t *image = read_file(path, &images[i].size);
+
+    if (!image) {
+      fprintf(stderr, "mango-opt: cannot read %s\n", path);
+      return 1;
+    }
+    if (!parse_fingerprint(path, fingerprints[i])) {
+      if (i != 0) {
+        fprintf(stderr, "mango-opt: %s is not named by its fingerprint\n",
+                path);
+        return 1;
+      }
+      memset(fingerprints[i], 0, sizeof(fingerprints[i]));
+    }
+
+    images[i].fingerprint = fingerprints[i];
+    images[i].image = image;
+    images[i].context = NULL;
+  }
+
+  if ((result = verify(images, count)) != MANGO_E_SUCCESS) {
+    fprintf(stderr, "mango-opt: cannot import program (%d)\n", (int)result);
+    return 1;
+  }
+
+  size_t size = mango_optimize_size(images, count);
+  void *buffer = malloc(size);
+  if (!buffer) {
+    fprintf(stderr, "mango-opt: out of memory\n");
+    return 1;
+  }
+
+  result = mango_optimize(images, count, buffer, size, optimized);
+  if (result != MANGO_E_SUCCESS) {
+    fprintf(stderr, "mango-opt: cannot optimize program (%d)\n", (int)result);
+    return 1;
+  }
+  if ((result = verify(optimized, count)) != MANGO_E_SUCCESS) {
+    fprintf(stderr, "mango-opt: cannot import optimized program (%d)\n",
+            (int)result);
+    return 1;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (!write_file(argv[2], argv[3 + i], optimized[i].image,
+                    optimized[i].size)) {
+      return 1;
+    }
+    printf("%s: %zu -> %zu bytes\n", argv[3 + i], images[i].size,
+           optimized[i].size);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    free((void *)images[i].image);
+  }
+  free(buffer);
+  return 0;
+}